@@ -0,0 +1,89 @@
+// Reader/writer scaling of ConcurrentMulti_Map and the lock-free skip list
+// against a mutex-wrapped Multi_Map, from 1 to 64 threads
+//
+//   g++ -std=c++17 -O2 bench_concurrent_multimap.cc -o bench_concurrent -lbenchmark -pthread
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <mutex>
+#include <random>
+
+#include "concurrent_multimap.h"
+#include "multimap.h"
+#include "skiplist_multimap.h"
+
+namespace {
+
+constexpr int kKeys = 1 << 16;
+
+// Baseline: every call takes one global lock
+class LockedMap {
+ public:
+  int Get(int key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return map_.Get(key);
+  }
+  void Insert(int key, int value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    map_.Insert(key, value);
+  }
+  bool Remove(int key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return map_.Remove(key);
+  }
+
+ private:
+  std::mutex mutex_;
+  Multi_Map<int, int> map_;
+};
+
+template <typename Map>
+Map &Shared() {
+  static Map *map = [] {
+    Map *m = new Map();
+    for (int i = 0; i < kKeys; i++)
+      m->Insert(i, i);
+    return m;
+  }();
+  return *map;
+}
+
+// Only reads
+template <typename Map>
+void BM_Get(benchmark::State &state) {
+  Map &map = Shared<Map>();
+  std::mt19937 rng(state.thread_index());
+  for (auto _ : state)
+    benchmark::DoNotOptimize(map.Get(rng() % kKeys));
+  state.SetItemsProcessed(state.iterations());
+}
+
+// One write, an insert paired with a remove so the size holds, per 16 ops
+template <typename Map>
+void BM_Mixed(benchmark::State &state) {
+  Map &map = Shared<Map>();
+  std::mt19937 rng(state.thread_index());
+  uint64_t op = 0;
+  for (auto _ : state) {
+    int key = rng() % kKeys;
+    if (++op % 16 == 0) {
+      map.Insert(key, -1);
+      map.Remove(key);
+    } else {
+      benchmark::DoNotOptimize(map.Get(key));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_Get, LockedMap)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Get, ConcurrentMulti_Map<int, int>)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Get, Multi_Map<int, int, SkipListBackend>)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Mixed, LockedMap)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Mixed, ConcurrentMulti_Map<int, int>)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Mixed, Multi_Map<int, int, SkipListBackend>)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,349 @@
+// Multi_Map against std::multimap and std::map<K, std::vector<V>>
+// Every benchmark reports ns/op, heap allocations per op and its own peak
+// RSS, the process peak being reset at its start. Sizes run from 1K up to MULTI_MAP_BENCH_MAX_SIZE
+// (default 1M) in steps of 10; set it to 100000000 for the full range.
+//
+//   g++ -std=c++17 -O2 -DNDEBUG bench_multimap.cc -o bench_multimap -lbenchmark -pthread
+
+#include <benchmark/benchmark.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "multimap.h"
+
+// Count every heap allocation made by the process
+static std::atomic<uint64_t> g_allocations{0};
+
+void *operator new(std::size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+using Key = int64_t;
+using Value = int64_t;
+
+// Uniform interface over the containers under test
+template <typename Backend>
+struct TreeMap {
+  Multi_Map<Key, Value, Backend> m;
+  void Insert(Key k, Value v) { m.Insert(k, v); }
+  const Value *Find(Key k) {
+    // Exact lookups through the index when there is one, else one descent
+    if constexpr (std::is_same<Backend, HashIndexBackend>::value)
+      return m.Contains(k) ? &m.Get(k) : nullptr;
+    auto it = m.lower_bound(k);
+    return it != m.end() && it->first == k ? &it->second : nullptr;
+  }
+  void FindMany(const Key *k, std::size_t n, const Value **out) { m.GetMany(k, n, out); }
+  bool Remove(Key k) { return m.Remove(k); }
+  Key Min() { return m.Min(); }
+  Value PopMin() { return m.PopMin(); }
+  template <typename F> void ForEach(F f) {
+    for (auto kv : m) f(kv.first, kv.second);
+  }
+};
+
+struct StdMultimap {
+  std::multimap<Key, Value> m;
+  void Insert(Key k, Value v) { m.emplace(k, v); }
+  const Value *Find(Key k) {
+    auto it = m.find(k);
+    return it != m.end() ? &it->second : nullptr;
+  }
+  void FindMany(const Key *k, std::size_t n, const Value **out) {
+    for (std::size_t i = 0; i < n; i++) out[i] = Find(k[i]);
+  }
+  bool Remove(Key k) {
+    auto it = m.find(k);
+    if (it == m.end()) return false;
+    m.erase(it);
+    return true;
+  }
+  Key Min() { return m.begin()->first; }
+  Value PopMin() {
+    Value v = m.begin()->second;
+    m.erase(m.begin());
+    return v;
+  }
+  template <typename F> void ForEach(F f) {
+    for (auto &kv : m) f(kv.first, kv.second);
+  }
+};
+
+struct StdMapOfVectors {
+  std::map<Key, std::vector<Value>> m;
+  void Insert(Key k, Value v) { m[k].push_back(v); }
+  const Value *Find(Key k) {
+    auto it = m.find(k);
+    return it != m.end() ? &it->second.front() : nullptr;
+  }
+  void FindMany(const Key *k, std::size_t n, const Value **out) {
+    for (std::size_t i = 0; i < n; i++) out[i] = Find(k[i]);
+  }
+  bool Remove(Key k) {
+    auto it = m.find(k);
+    if (it == m.end()) return false;
+    if (it->second.size() == 1)
+      m.erase(it);
+    else
+      it->second.erase(it->second.begin());
+    return true;
+  }
+  Key Min() { return m.begin()->first; }
+  Value PopMin() {
+    auto it = m.begin();
+    Value v = it->second.front();
+    if (it->second.size() == 1)
+      m.erase(it);
+    else
+      it->second.erase(it->second.begin());
+    return v;
+  }
+  template <typename F> void ForEach(F f) {
+    for (auto &kv : m)
+      for (Value v : kv.second) f(kv.first, v);
+  }
+};
+
+enum KeyOrder { kRandom, kSorted, kDuplicates };
+
+// @n keys: a shuffled permutation, ascending, or about 100 copies each
+std::vector<Key> MakeKeys(std::size_t n, KeyOrder order) {
+  std::vector<Key> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  if (order == kDuplicates)
+    for (Key &k : keys) k /= 100;
+  if (order != kSorted)
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(42));
+  return keys;
+}
+
+template <typename Map>
+void Fill(Map &map, const std::vector<Key> &keys) {
+  for (std::size_t i = 0; i < keys.size(); i++)
+    map.Insert(keys[i], static_cast<Value>(i));
+}
+
+// Reset the peak RSS the kernel keeps for the process to its current RSS,
+// first handing the heap earlier benchmarks freed back to the system
+void ResetPeakRss() {
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+  if (std::FILE *f = std::fopen("/proc/self/clear_refs", "w")) {
+    std::fputs("5", f);
+    std::fclose(f);
+  }
+}
+
+// Return the peak RSS in KiB since the last ResetPeakRss, 0 if unknown
+long PeakRssKiB() {
+  std::FILE *f = std::fopen("/proc/self/status", "r");
+  if (!f)
+    return 0;
+  char line[256];
+  long kib = 0;
+  while (std::fgets(line, sizeof(line), f))
+    if (std::strncmp(line, "VmHWM:", 6) == 0)
+      std::sscanf(line + 6, "%ld", &kib);
+  std::fclose(f);
+  return kib;
+}
+
+// Attach @allocs spread over @ops and the peak RSS since the benchmark began
+void Report(benchmark::State &state, uint64_t allocs, uint64_t ops) {
+  state.SetItemsProcessed(ops);
+  state.counters["allocs/op"] = ops ? static_cast<double>(allocs) / ops : 0.0;
+  state.counters["peak_rss_MB"] = PeakRssKiB() / 1024.0;
+}
+
+template <typename Map, KeyOrder Order>
+void BM_Insert(benchmark::State &state) {
+  ResetPeakRss();
+  std::vector<Key> keys = MakeKeys(state.range(0), Order);
+  uint64_t allocs = 0, ops = 0;
+  for (auto _ : state) {
+    Map *map = new Map();
+    uint64_t before = g_allocations.load();
+    Fill(*map, keys);
+    allocs += g_allocations.load() - before;
+    ops += keys.size();
+    state.PauseTiming();
+    delete map;
+    state.ResumeTiming();
+  }
+  Report(state, allocs, ops);
+}
+
+// Stored keys are even, so odd probes always miss
+template <typename Map, bool Hit>
+void BM_Get(benchmark::State &state) {
+  ResetPeakRss();
+  std::vector<Key> keys = MakeKeys(state.range(0), kRandom);
+  Map map;
+  for (std::size_t i = 0; i < keys.size(); i++)
+    map.Insert(keys[i] * 2, static_cast<Value>(i));
+  std::vector<Key> probes(keys.begin(), keys.begin() + std::min<std::size_t>(keys.size(), 1 << 16));
+  for (Key &k : probes) k = k * 2 + (Hit ? 0 : 1);
+  std::size_t i = 0;
+  uint64_t start = g_allocations.load();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map.Find(probes[i]));
+    if (++i == probes.size()) i = 0;
+  }
+  Report(state, g_allocations.load() - start, state.iterations());
+}
+
+// Hits in batches of 256, the middle of the 64-1024 range callers use
+template <typename Map>
+void BM_GetMany(benchmark::State &state) {
+  ResetPeakRss();
+  std::vector<Key> keys = MakeKeys(state.range(0), kRandom);
+  Map map;
+  Fill(map, keys);
+  std::vector<Key> probes(keys.begin(), keys.begin() + std::min<std::size_t>(keys.size(), 1 << 16));
+  std::shuffle(probes.begin(), probes.end(), std::mt19937_64(3));
+  const std::size_t batch = std::min<std::size_t>(256, probes.size());
+  std::vector<const Value *> out(batch);
+  std::size_t i = 0;
+  uint64_t start = g_allocations.load();
+  for (auto _ : state) {
+    map.FindMany(probes.data() + i, batch, out.data());
+    benchmark::DoNotOptimize(out.data());
+    i += batch;
+    if (i + batch > probes.size()) i = 0;
+  }
+  Report(state, g_allocations.load() - start, state.iterations() * batch);
+}
+
+template <typename Map>
+void BM_Remove(benchmark::State &state) {
+  ResetPeakRss();
+  std::vector<Key> keys = MakeKeys(state.range(0), kRandom);
+  std::vector<Key> order = keys;
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(7));
+  uint64_t allocs = 0, ops = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    Map *map = new Map();
+    Fill(*map, keys);
+    uint64_t before = g_allocations.load();
+    state.ResumeTiming();
+    for (Key k : order)
+      benchmark::DoNotOptimize(map->Remove(k));
+    state.PauseTiming();
+    allocs += g_allocations.load() - before;
+    ops += order.size();
+    delete map;
+    state.ResumeTiming();
+  }
+  Report(state, allocs, ops);
+}
+
+template <typename Map>
+void BM_PopMin(benchmark::State &state) {
+  ResetPeakRss();
+  std::vector<Key> keys = MakeKeys(state.range(0), kDuplicates);
+  uint64_t allocs = 0, ops = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    Map *map = new Map();
+    Fill(*map, keys);
+    uint64_t before = g_allocations.load();
+    state.ResumeTiming();
+    for (std::size_t i = 0; i < keys.size(); i++)
+      benchmark::DoNotOptimize(map->PopMin());
+    state.PauseTiming();
+    allocs += g_allocations.load() - before;
+    ops += keys.size();
+    delete map;
+    state.ResumeTiming();
+  }
+  Report(state, allocs, ops);
+}
+
+template <typename Map>
+void BM_Min(benchmark::State &state) {
+  ResetPeakRss();
+  Map map;
+  Fill(map, MakeKeys(state.range(0), kRandom));
+  uint64_t start = g_allocations.load();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(map.Min());
+  Report(state, g_allocations.load() - start, state.iterations());
+}
+
+template <typename Map>
+void BM_Iterate(benchmark::State &state) {
+  ResetPeakRss();
+  Map map;
+  Fill(map, MakeKeys(state.range(0), kDuplicates));
+  uint64_t start = g_allocations.load();
+  uint64_t ops = 0;
+  for (auto _ : state) {
+    Value sum = 0;
+    map.ForEach([&](Key, Value v) { sum += v; });
+    benchmark::DoNotOptimize(sum);
+    ops += state.range(0);
+  }
+  Report(state, g_allocations.load() - start, ops);
+}
+
+template <typename Map>
+void RegisterAll(const char *name, int64_t max_size) {
+  std::string n(name);
+  benchmark::internal::Benchmark *all[] = {
+      benchmark::RegisterBenchmark(("Insert/Random/" + n).c_str(), BM_Insert<Map, kRandom>),
+      benchmark::RegisterBenchmark(("Insert/Sorted/" + n).c_str(), BM_Insert<Map, kSorted>),
+      benchmark::RegisterBenchmark(("Insert/Duplicates/" + n).c_str(), BM_Insert<Map, kDuplicates>),
+      benchmark::RegisterBenchmark(("Get/Hit/" + n).c_str(), BM_Get<Map, true>),
+      benchmark::RegisterBenchmark(("Get/Miss/" + n).c_str(), BM_Get<Map, false>),
+      benchmark::RegisterBenchmark(("GetMany/" + n).c_str(), BM_GetMany<Map>),
+      benchmark::RegisterBenchmark(("Remove/" + n).c_str(), BM_Remove<Map>),
+      benchmark::RegisterBenchmark(("Min/" + n).c_str(), BM_Min<Map>),
+      benchmark::RegisterBenchmark(("PopMin/" + n).c_str(), BM_PopMin<Map>),
+      benchmark::RegisterBenchmark(("Iterate/" + n).c_str(), BM_Iterate<Map>),
+  };
+  for (benchmark::internal::Benchmark *b : all)
+    for (int64_t size = 1000; size <= max_size; size *= 10)
+      b->Arg(size);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int64_t max_size = 1000000;
+  if (const char *env = std::getenv("MULTI_MAP_BENCH_MAX_SIZE"))
+    max_size = std::max<int64_t>(1000, std::atoll(env));
+  RegisterAll<TreeMap<RBTreeBackend>>("Multi_Map", max_size);
+  RegisterAll<TreeMap<HashIndexBackend>>("Multi_Map+hash", max_size);
+  RegisterAll<StdMultimap>("std::multimap", max_size);
+  RegisterAll<StdMapOfVectors>("std::map<vector>", max_size);
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
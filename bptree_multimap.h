@@ -0,0 +1,584 @@
+#ifndef BPTREE_MULTIMAP_H_
+#define BPTREE_MULTIMAP_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "multimap.h"
+#include "node_search.h"
+
+// Backend policy for a B+-tree whose nodes hold sorted key arrays of about
+// @NodeBytes bytes
+template <unsigned NodeBytes = 256>
+struct BPlusTreeBackend {};
+
+// Multi-Map implementation using a B+-tree
+// Inner nodes hold only separator keys; all entries live in leaves linked
+// in key order. Duplicates are separate entries kept in insertion order,
+// so the first value of a key is the leftmost entry with that key. Keys
+// and values must be default constructible and movable.
+template <typename K, typename V, unsigned NodeBytes>
+class Multi_Map<K, V, BPlusTreeBackend<NodeBytes>> {
+ public:
+  // Constructor
+  Multi_Map() {}
+
+  // Destructor
+  ~Multi_Map() {
+    Clear();
+  }
+
+  // Nodes are owned by the pools, so the tree cannot be copied
+  Multi_Map(const Multi_Map &) = delete;
+  Multi_Map &operator=(const Multi_Map &) = delete;
+
+  // Return size of tree
+  unsigned int Size();
+  // Return value associated to @key
+  const V& Get(const K& key);
+  // Return whether @key is found in tree
+  bool Contains(const K& key);
+  // Return max key in tree
+  const K& Max();
+  // Return min key in tree
+  const K& Min();
+  // Remove and return the first value of the min key
+  V PopMin();
+  // Insert @key in tree
+  void Insert(const K &key, const V &value);
+  // Insert @key in tree, moving the key and value in
+  void Insert(K &&key, V &&value);
+  // Remove the first value of @key, return whether anything was removed
+  bool Remove(const K &key);
+  // Remove every key and release all node memory
+  void Clear();
+  // Print tree in-order
+  void Print();
+  // Call @f(key, value) for every pair in key order
+  template <typename F>
+  void ForEach(F f);
+  // Write every pair to @sink in @format, through one large buffer
+  void Dump(DumpSink &sink, DumpFormat format = DumpFormat::kText);
+
+ private:
+  // Keys per node, enough to fill about @NodeBytes
+  static constexpr unsigned kKeys =
+      NodeBytes / sizeof(K) < 4 ? 4 : NodeBytes / sizeof(K);
+  // Fill below which a node borrows from or merges with a sibling
+  static constexpr unsigned kMinKeys = kKeys / 2;
+  // Every inner node has at least two children
+  static constexpr int kMaxHeight = std::numeric_limits<unsigned int>::digits;
+
+  // Key arrays come first so a search only touches whole cache lines
+  struct alignas(64) Leaf {
+    K keys[kKeys];
+    unsigned count = 0;
+    Leaf *prev = nullptr;
+    Leaf *next = nullptr;
+    V values[kKeys];
+  };
+  struct alignas(64) Inner {
+    K keys[kKeys];
+    unsigned count = 0;  // number of keys, children is one more
+    void *children[kKeys + 1];
+  };
+  // Inner node on a root-to-leaf path and the child index taken
+  struct Step {
+    Inner *node;
+    unsigned i;
+  };
+
+  void *root = nullptr;   // a Leaf when height is 0
+  int height = 0;
+  Leaf *head = nullptr;   // first leaf, holds the min key
+  Leaf *tail = nullptr;   // last leaf, holds the max key
+  unsigned int cur_size = 0;
+  NodePool<Leaf> leaves;
+  NodePool<Inner> inners;
+
+  // Search helpers over a sorted key array
+  static unsigned LowerBound(const K *keys, unsigned n, const K &key);
+  static unsigned UpperBound(const K *keys, unsigned n, const K &key);
+
+  // Iterative helper methods
+  bool Find(const K &key, Leaf *&leaf, unsigned &pos);
+  template <typename KK, typename VV>
+  void InsertEntry(KK &&key, VV &&value);
+  Leaf* Descend(const K &key, bool upper, Step *path);
+  Leaf* AdvanceLeaf(Step *path);
+  void EraseAt(Step *path, Leaf *leaf, unsigned pos);
+  void InsertIntoParent(Step *path, int depth, K sep, void *child);
+  void RebalanceLeaf(Step *path, Leaf *leaf);
+  void RebalanceInner(Step *path, int depth);
+  void RemoveChild(Inner *p, unsigned sep);
+
+  // Recursive helper methods
+  void Destroy(void *n, int h);
+};
+
+template <typename K, typename V, unsigned NB>
+unsigned Multi_Map<K, V, BPlusTreeBackend<NB>>::LowerBound(const K *keys,
+                                                          unsigned n,
+                                                          const K &key) {
+  return NodeSearch<K>::LowerBound(keys, n, key);
+}
+
+template <typename K, typename V, unsigned NB>
+unsigned Multi_Map<K, V, BPlusTreeBackend<NB>>::UpperBound(const K *keys,
+                                                          unsigned n,
+                                                          const K &key) {
+  return NodeSearch<K>::UpperBound(keys, n, key);
+}
+
+template <typename K, typename V, unsigned NB>
+unsigned int Multi_Map<K, V, BPlusTreeBackend<NB>>::Size() {
+  return cur_size;
+}
+
+// Locate the first entry with @key; separators are inclusive on both sides,
+// so a lower-bound descent can land one past the end of the leaf before it
+template <typename K, typename V, unsigned NB>
+bool Multi_Map<K, V, BPlusTreeBackend<NB>>::Find(const K &key, Leaf *&leaf,
+                                                 unsigned &pos) {
+  if (!root)
+    return false;
+  void *n = root;
+  for (int h = height; h > 0; h--) {
+    Inner *in = static_cast<Inner*>(n);
+    n = in->children[LowerBound(in->keys, in->count, key)];
+  }
+  leaf = static_cast<Leaf*>(n);
+  pos = LowerBound(leaf->keys, leaf->count, key);
+  if (pos == leaf->count) {
+    leaf = leaf->next;
+    pos = 0;
+  }
+  return leaf && leaf->keys[pos] == key;
+}
+
+template <typename K, typename V, unsigned NB>
+const V& Multi_Map<K, V, BPlusTreeBackend<NB>>::Get(const K &key) {
+  Leaf *leaf;
+  unsigned pos;
+  if (!Find(key, leaf, pos))
+    throw std::runtime_error("Error: cannot find key");
+  return leaf->values[pos];
+}
+
+template <typename K, typename V, unsigned NB>
+bool Multi_Map<K, V, BPlusTreeBackend<NB>>::Contains(const K &key) {
+  Leaf *leaf;
+  unsigned pos;
+  return Find(key, leaf, pos);
+}
+
+template <typename K, typename V, unsigned NB>
+const K& Multi_Map<K, V, BPlusTreeBackend<NB>>::Max() {
+  return tail->keys[tail->count - 1];
+}
+
+template <typename K, typename V, unsigned NB>
+const K& Multi_Map<K, V, BPlusTreeBackend<NB>>::Min() {
+  return head->keys[0];
+}
+
+template <typename K, typename V, unsigned NB>
+V Multi_Map<K, V, BPlusTreeBackend<NB>>::PopMin() {
+  if (!root)
+    throw std::runtime_error("Error: tree is empty");
+  Step path[kMaxHeight];
+  void *n = root;
+  for (int d = 0; d < height; d++) {
+    Inner *in = static_cast<Inner*>(n);
+    path[d] = {in, 0};
+    n = in->children[0];
+  }
+  V value = std::move(head->values[0]);
+  EraseAt(path, head, 0);
+  return value;
+}
+
+// Walk from the root to a leaf, recording the path. @upper picks the
+// rightmost child that may hold @key (where a new duplicate goes), else
+// the leftmost (where its first value is).
+template <typename K, typename V, unsigned NB>
+typename Multi_Map<K, V, BPlusTreeBackend<NB>>::Leaf*
+Multi_Map<K, V, BPlusTreeBackend<NB>>::Descend(const K &key, bool upper,
+                                               Step *path) {
+  void *n = root;
+  for (int d = 0; d < height; d++) {
+    Inner *in = static_cast<Inner*>(n);
+    unsigned i = upper ? UpperBound(in->keys, in->count, key)
+                       : LowerBound(in->keys, in->count, key);
+    path[d] = {in, i};
+    n = in->children[i];
+  }
+  return static_cast<Leaf*>(n);
+}
+
+// Move @path on to the next leaf, return nullptr past the last one
+template <typename K, typename V, unsigned NB>
+typename Multi_Map<K, V, BPlusTreeBackend<NB>>::Leaf*
+Multi_Map<K, V, BPlusTreeBackend<NB>>::AdvanceLeaf(Step *path) {
+  int d = height - 1;
+  while (d >= 0 && path[d].i == path[d].node->count)
+    d--;
+  if (d < 0)
+    return nullptr;
+  void *n = path[d].node->children[++path[d].i];
+  for (d++; d < height; d++) {
+    Inner *in = static_cast<Inner*>(n);
+    path[d] = {in, 0};
+    n = in->children[0];
+  }
+  return static_cast<Leaf*>(n);
+}
+
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::Insert(const K &key,
+                                                   const V &value) {
+  InsertEntry(key, value);
+}
+
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::Insert(K &&key, V &&value) {
+  InsertEntry(std::move(key), std::move(value));
+}
+
+template <typename K, typename V, unsigned NB>
+template <typename KK, typename VV>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::InsertEntry(KK &&key,
+                                                        VV &&value) {
+  if (!root) {
+    head = tail = leaves.New();
+    root = head;
+    height = 0;
+  }
+
+  Step path[kMaxHeight];
+  Leaf *leaf = Descend(key, true, path);
+  unsigned pos = UpperBound(leaf->keys, leaf->count, key);
+  cur_size++;
+
+  if (leaf->count == kKeys) {
+    // Split: the upper half moves to a new leaf linked after this one
+    Leaf *right = leaves.New();
+    unsigned half = kKeys / 2;
+    std::move(leaf->keys + half, leaf->keys + kKeys, right->keys);
+    std::move(leaf->values + half, leaf->values + kKeys, right->values);
+    right->count = kKeys - half;
+    leaf->count = half;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+      leaf->next->prev = right;
+    else
+      tail = right;
+    leaf->next = right;
+
+    K sep = right->keys[0];
+    if (pos > half) {
+      pos -= half;
+      leaf = right;
+    }
+    std::move_backward(leaf->keys + pos, leaf->keys + leaf->count,
+                       leaf->keys + leaf->count + 1);
+    std::move_backward(leaf->values + pos, leaf->values + leaf->count,
+                       leaf->values + leaf->count + 1);
+    leaf->keys[pos] = std::forward<KK>(key);
+    leaf->values[pos] = std::forward<VV>(value);
+    leaf->count++;
+    InsertIntoParent(path, height, std::move(sep), right);
+    return;
+  }
+
+  std::move_backward(leaf->keys + pos, leaf->keys + leaf->count,
+                     leaf->keys + leaf->count + 1);
+  std::move_backward(leaf->values + pos, leaf->values + leaf->count,
+                     leaf->values + leaf->count + 1);
+  leaf->keys[pos] = std::forward<KK>(key);
+  leaf->values[pos] = std::forward<VV>(value);
+  leaf->count++;
+}
+
+// Hang @child to the right of the child taken at path[depth - 1],
+// splitting inner nodes on the way up as needed
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::InsertIntoParent(Step *path,
+                                                             int depth,
+                                                             K sep,
+                                                             void *child) {
+  while (depth > 0) {
+    Inner *p = path[--depth].node;
+    unsigned i = path[depth].i;
+    if (p->count < kKeys) {
+      std::move_backward(p->keys + i, p->keys + p->count,
+                         p->keys + p->count + 1);
+      std::move_backward(p->children + i + 1, p->children + p->count + 1,
+                         p->children + p->count + 2);
+      p->keys[i] = std::move(sep);
+      p->children[i + 1] = child;
+      p->count++;
+      return;
+    }
+
+    // Split: lay out the kKeys + 1 keys in order, the middle one moves up
+    K keys[kKeys + 1];
+    void *children[kKeys + 2];
+    std::move(p->keys, p->keys + i, keys);
+    keys[i] = std::move(sep);
+    std::move(p->keys + i, p->keys + kKeys, keys + i + 1);
+    std::copy(p->children, p->children + i + 1, children);
+    children[i + 1] = child;
+    std::copy(p->children + i + 1, p->children + kKeys + 1, children + i + 2);
+
+    unsigned mid = (kKeys + 1) / 2;
+    Inner *q = inners.New();
+    std::move(keys, keys + mid, p->keys);
+    std::copy(children, children + mid + 1, p->children);
+    p->count = mid;
+    std::move(keys + mid + 1, keys + kKeys + 1, q->keys);
+    std::copy(children + mid + 1, children + kKeys + 2, q->children);
+    q->count = kKeys - mid;
+    sep = std::move(keys[mid]);
+    child = q;
+  }
+
+  // The root split, grow a level
+  Inner *r = inners.New();
+  r->keys[0] = std::move(sep);
+  r->children[0] = root;
+  r->children[1] = child;
+  r->count = 1;
+  root = r;
+  height++;
+}
+
+template <typename K, typename V, unsigned NB>
+bool Multi_Map<K, V, BPlusTreeBackend<NB>>::Remove(const K &key) {
+  if (!root)
+    return false;
+  Step path[kMaxHeight];
+  Leaf *leaf = Descend(key, false, path);
+  unsigned pos = LowerBound(leaf->keys, leaf->count, key);
+  if (pos == leaf->count) {
+    leaf = AdvanceLeaf(path);
+    pos = 0;
+  }
+  if (!leaf || !(leaf->keys[pos] == key))
+    return false;
+  EraseAt(path, leaf, pos);
+  return true;
+}
+
+// Drop entry @pos of @leaf, reached through @path
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::EraseAt(Step *path, Leaf *leaf,
+                                                    unsigned pos) {
+  std::move(leaf->keys + pos + 1, leaf->keys + leaf->count, leaf->keys + pos);
+  std::move(leaf->values + pos + 1, leaf->values + leaf->count,
+            leaf->values + pos);
+  leaf->count--;
+  cur_size--;
+
+  if (height == 0) {
+    if (leaf->count == 0) {
+      leaves.Delete(leaf);
+      root = head = tail = nullptr;
+    }
+    return;
+  }
+  if (leaf->count < kMinKeys)
+    RebalanceLeaf(path, leaf);
+}
+
+// Refill an underfull leaf from a sibling, or merge it into one
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::RebalanceLeaf(Step *path,
+                                                          Leaf *leaf) {
+  Inner *p = path[height - 1].node;
+  unsigned i = path[height - 1].i;
+  Leaf *left = i > 0 ? static_cast<Leaf*>(p->children[i - 1]) : nullptr;
+  Leaf *right = i < p->count ? static_cast<Leaf*>(p->children[i + 1]) : nullptr;
+
+  if (left && left->count > kMinKeys) {
+    // Borrow the last entry of the left sibling
+    std::move_backward(leaf->keys, leaf->keys + leaf->count,
+                       leaf->keys + leaf->count + 1);
+    std::move_backward(leaf->values, leaf->values + leaf->count,
+                       leaf->values + leaf->count + 1);
+    left->count--;
+    leaf->keys[0] = std::move(left->keys[left->count]);
+    leaf->values[0] = std::move(left->values[left->count]);
+    leaf->count++;
+    p->keys[i - 1] = leaf->keys[0];
+    return;
+  }
+  if (right && right->count > kMinKeys) {
+    // Borrow the first entry of the right sibling
+    leaf->keys[leaf->count] = std::move(right->keys[0]);
+    leaf->values[leaf->count] = std::move(right->values[0]);
+    leaf->count++;
+    std::move(right->keys + 1, right->keys + right->count, right->keys);
+    std::move(right->values + 1, right->values + right->count, right->values);
+    right->count--;
+    p->keys[i] = right->keys[0];
+    return;
+  }
+
+  // Merge the right one of the pair into the left one
+  unsigned sep = i;
+  if (left) {
+    right = leaf;
+    leaf = left;
+    sep = i - 1;
+  }
+  std::move(right->keys, right->keys + right->count, leaf->keys + leaf->count);
+  std::move(right->values, right->values + right->count,
+            leaf->values + leaf->count);
+  leaf->count += right->count;
+  leaf->next = right->next;
+  if (right->next)
+    right->next->prev = leaf;
+  else
+    tail = leaf;
+  leaves.Delete(right);
+  RemoveChild(p, sep);
+  RebalanceInner(path, height - 1);
+}
+
+// Drop separator @sep of @p together with the child to its right
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::RemoveChild(Inner *p,
+                                                        unsigned sep) {
+  std::move(p->keys + sep + 1, p->keys + p->count, p->keys + sep);
+  std::copy(p->children + sep + 2, p->children + p->count + 1,
+            p->children + sep + 1);
+  p->count--;
+}
+
+// Fix up path[depth].node after it lost a child
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::RebalanceInner(Step *path,
+                                                           int depth) {
+  while (true) {
+    Inner *n = path[depth].node;
+    if (depth == 0) {
+      // A root left with a single child hands the tree down a level
+      if (n->count == 0) {
+        root = n->children[0];
+        height--;
+        inners.Delete(n);
+      }
+      return;
+    }
+    if (n->count >= kMinKeys)
+      return;
+
+    Inner *p = path[depth - 1].node;
+    unsigned i = path[depth - 1].i;
+    Inner *left = i > 0 ? static_cast<Inner*>(p->children[i - 1]) : nullptr;
+    Inner *right = i < p->count ? static_cast<Inner*>(p->children[i + 1])
+                                : nullptr;
+
+    if (left && left->count > kMinKeys) {
+      // Rotate the left sibling's last child through the parent
+      std::move_backward(n->keys, n->keys + n->count, n->keys + n->count + 1);
+      std::copy_backward(n->children, n->children + n->count + 1,
+                         n->children + n->count + 2);
+      n->keys[0] = std::move(p->keys[i - 1]);
+      n->children[0] = left->children[left->count];
+      p->keys[i - 1] = std::move(left->keys[left->count - 1]);
+      left->count--;
+      n->count++;
+      return;
+    }
+    if (right && right->count > kMinKeys) {
+      // Rotate the right sibling's first child through the parent
+      n->keys[n->count] = std::move(p->keys[i]);
+      n->children[n->count + 1] = right->children[0];
+      n->count++;
+      p->keys[i] = std::move(right->keys[0]);
+      std::move(right->keys + 1, right->keys + right->count, right->keys);
+      std::copy(right->children + 1, right->children + right->count + 1,
+                right->children);
+      right->count--;
+      return;
+    }
+
+    // Merge the pair around their parent separator
+    unsigned sep = i;
+    if (left) {
+      right = n;
+      n = left;
+      sep = i - 1;
+    }
+    n->keys[n->count] = std::move(p->keys[sep]);
+    std::move(right->keys, right->keys + right->count,
+              n->keys + n->count + 1);
+    std::copy(right->children, right->children + right->count + 1,
+              n->children + n->count + 1);
+    n->count += right->count + 1;
+    inners.Delete(right);
+    RemoveChild(p, sep);
+    depth--;
+  }
+}
+
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::Clear() {
+  // Payload destructors need a walk; trivial ones go with their chunks
+  if (root && !(std::is_trivially_destructible<Leaf>::value &&
+                std::is_trivially_destructible<Inner>::value))
+    Destroy(root, height);
+  // The slots themselves go back chunk by chunk
+  leaves.Release();
+  inners.Release();
+  root = nullptr;
+  head = tail = nullptr;
+  height = 0;
+  cur_size = 0;
+}
+
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::Destroy(void *n, int h) {
+  if (h == 0) {
+    static_cast<Leaf*>(n)->~Leaf();
+    return;
+  }
+  Inner *in = static_cast<Inner*>(n);
+  for (unsigned i = 0; i <= in->count; i++)
+    Destroy(in->children[i], h - 1);
+  in->~Inner();
+}
+
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::Print() {
+  StreamSink sink(std::cout);
+  Dump(sink, DumpFormat::kText);
+  std::cout << std::endl;
+}
+
+// Walk the leaf chain; equal keys sit side by side in insertion order, so
+// kText groups them the way the red-black tree prints a node
+template <typename K, typename V, unsigned NB>
+template <typename F>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::ForEach(F f) {
+  for (Leaf *l = head; l; l = l->next)
+    for (unsigned i = 0; i < l->count; i++)
+      f(static_cast<const K&>(l->keys[i]), l->values[i]);
+}
+
+template <typename K, typename V, unsigned NB>
+void Multi_Map<K, V, BPlusTreeBackend<NB>>::Dump(DumpSink &sink, DumpFormat format) {
+  DumpWriter<K, V> out(sink, format);
+  ForEach([&](const K &key, const V &value) { out.Pair(key, value); });
+  out.Finish();
+}
+
+#endif  // BPTREE_MULTIMAP_H_
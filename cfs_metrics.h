@@ -0,0 +1,288 @@
+#ifndef CFS_METRICS_H_
+#define CFS_METRICS_H_
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Metrics of a cfs_sched run
+// Every CPU gathers its own, so worker threads never share a counter:
+// histograms of how long tasks waited to be picked and of their
+// turnaround, and, while a stream is being written, its Multi_Map
+// operation times and the tasks it finished. At the epoch barriers the
+// main thread turns these into rows of a MetricsWriter stream, which is
+// written through one large buffer rather than per event.
+//
+// A binary stream is a MetricsHeader followed by records, each one tag
+// byte and the fixed-size record below, in host byte order. A CSV stream
+// has one row per record, the record type first:
+//   cfs_metrics,<version>,<cpus>,<epoch_ticks>
+//   sample,<tick>,<cpu>,<runnable>,<switches>,<migrations>,<map_ops>,<map_ns>
+//   task,<id>,<cpu>,<start>,<finish>,<wait>
+//   wait|turnaround,<cpu>,<low>,<count>
+// Sample counters are deltas since the CPU's previous sample. Histogram
+// rows come last, one per non-empty bucket of values from <low> up to the
+// next row's.
+
+struct MetricsHeader {
+  char magic[8];         // kMetricsMagic
+  uint32_t version;      // kMetricsVersion
+  uint32_t cpus;
+  uint64_t epoch_ticks;  // ticks between samples are a multiple of this
+};
+
+// Tag 'S': one CPU at the end of an epoch
+struct SampleRecord {
+  uint64_t tick;
+  uint32_t cpu;
+  uint32_t runnable;    // queued plus running
+  uint64_t switches;
+  uint64_t migrations;  // tasks pulled in by balancing
+  uint64_t map_ops;     // runqueue and event queue operations
+  uint64_t map_ns;      // time spent in them, estimated from a sample
+};
+
+// Tag 'T': one finished task
+struct TaskMetrics {
+  uint64_t start;   // arrival tick
+  uint64_t finish;
+  uint64_t wait;    // ticks runnable but not running
+  uint32_t id;
+  uint32_t cpu;     // where it finished
+};
+
+// Tag 'H': one histogram bucket
+struct BucketRecord {
+  uint64_t low;    // smallest value the bucket holds
+  uint64_t count;
+  uint32_t cpu;
+  uint32_t kind;   // HistogramKind
+};
+
+static_assert(sizeof(MetricsHeader) == 24, "metrics header layout");
+static_assert(sizeof(SampleRecord) == 48, "sample record layout");
+static_assert(sizeof(TaskMetrics) == 32, "task record layout");
+static_assert(sizeof(BucketRecord) == 24, "bucket record layout");
+
+constexpr char kMetricsMagic[8] = {'C', 'F', 'S', 'M', 'E', 'T', 'R', 'C'};
+constexpr uint32_t kMetricsVersion = 1;
+
+enum HistogramKind : uint32_t { kWaitHistogram, kTurnaroundHistogram };
+
+// Log-linear histogram of tick counts, laid out like HdrHistogram: values
+// below 2^kSubBits are counted exactly and every power of two above that
+// is cut into 2^(kSubBits-1) buckets, so any value is known to within
+// about 3% in a fixed 15 KiB however large it gets
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBits = 6;
+  static constexpr uint64_t kHalf = uint64_t(1) << (kSubBits - 1);
+  static constexpr std::size_t kBuckets = (64 - kSubBits + 2) * kHalf;
+
+  void Record(uint64_t v) {
+    counts_[Index(v)]++;
+    count_++;
+    sum_ += v;
+    max_ = std::max(max_, v);
+  }
+
+  void Merge(const LatencyHistogram &other) {
+    for (std::size_t i = 0; i < kBuckets; i++)
+      counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+  double Mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+  // Return the largest value of the bucket holding the @q quantile
+  uint64_t Percentile(double q) const {
+    uint64_t rank = static_cast<uint64_t>(q * count_);
+    rank = std::min(rank, count_ ? count_ - 1 : 0);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen > rank)
+        return std::min(max_, Low(i) + Width(i) - 1);
+    }
+    return 0;
+  }
+
+  // Call @f(low, count) for every non-empty bucket in value order
+  template <typename F>
+  void ForEach(F f) const {
+    for (std::size_t i = 0; i < kBuckets; i++)
+      if (counts_[i])
+        f(Low(i), counts_[i]);
+  }
+
+ private:
+  static int Log2(uint64_t v) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(v);
+#else
+    int e = 0;
+    while (v >>= 1) e++;
+    return e;
+#endif
+  }
+
+  static std::size_t Index(uint64_t v) {
+    if (v < 2 * kHalf)
+      return static_cast<std::size_t>(v);
+    int shift = Log2(v) - kSubBits + 1;
+    return static_cast<std::size_t>(shift * kHalf + (v >> shift));
+  }
+  static int Shift(std::size_t i) { return i < 2 * kHalf ? 0 : static_cast<int>(i / kHalf) - 1; }
+  static uint64_t Low(std::size_t i) { return (i - Shift(i) * kHalf) << Shift(i); }
+  static uint64_t Width(std::size_t i) { return uint64_t(1) << Shift(i); }
+
+  std::array<uint64_t, kBuckets> counts_{};
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
+
+// What one CPU gathers between barriers
+struct CpuMetrics {
+  // One map operation in this many is timed, as a clock read costs about
+  // as much as the operation
+  static constexpr uint64_t kTimeEvery = 64;
+
+  LatencyHistogram wait;        // per pick, ticks since the task became runnable
+  LatencyHistogram turnaround;  // per task, ticks from arrival to finish
+  // Only kept while a stream is being written
+  bool streaming = false;
+  uint64_t map_ops = 0;
+  uint64_t map_ns = 0;            // estimated from the timed operations
+  std::vector<TaskMetrics> done;  // finished since the last barrier
+
+  // Run the map operation @f and return what it does, counting it when
+  // streaming and timing every kTimeEvery-th
+  template <typename F>
+  auto Time(F &&f) -> decltype(f()) {
+    if (!streaming || ++map_ops % kTimeEvery != 0)
+      return f();
+    struct Scope {
+      uint64_t &ns;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      ~Scope() {
+        ns += kTimeEvery * std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start).count();
+      }
+    } scope{map_ns};
+    return f();
+  }
+};
+
+// Stream of metrics records to a file, binary or CSV
+class MetricsWriter {
+ public:
+  enum Format { kBinary, kCsv };
+
+  MetricsWriter(const char *path, Format format, unsigned cpus, uint64_t epoch_ticks)
+      : format_(format), buffer_(1 << 20), last_(cpus) {
+    file_ = std::fopen(path, format == kCsv ? "w" : "wb");
+    if (!file_)
+      throw std::runtime_error(std::string("Error: cannot create file ") + path);
+    std::setvbuf(file_, buffer_.data(), _IOFBF, buffer_.size());
+    if (format_ == kBinary) {
+      MetricsHeader header{};
+      std::memcpy(header.magic, kMetricsMagic, sizeof(kMetricsMagic));
+      header.version = kMetricsVersion;
+      header.cpus = cpus;
+      header.epoch_ticks = epoch_ticks;
+      std::fwrite(&header, sizeof(header), 1, file_);
+    } else {
+      Row("cfs_metrics", {kMetricsVersion, cpus, epoch_ticks});
+    }
+  }
+
+  ~MetricsWriter() {
+    if (file_)
+      std::fclose(file_);
+  }
+
+  MetricsWriter(const MetricsWriter &) = delete;
+  MetricsWriter &operator=(const MetricsWriter &) = delete;
+
+  // Write a sample of CPU @cpu at @tick from its running totals
+  void Sample(uint64_t tick, uint32_t cpu, uint32_t runnable, uint64_t switches,
+              uint64_t migrations, const CpuMetrics &m) {
+    Totals &last = last_[cpu];
+    SampleRecord r{tick, cpu, runnable, switches - last.switches,
+                   migrations - last.migrations, m.map_ops - last.map_ops,
+                   m.map_ns - last.map_ns};
+    last = Totals{switches, migrations, m.map_ops, m.map_ns};
+    if (format_ == kBinary)
+      Put('S', r);
+    else
+      Row("sample", {r.tick, r.cpu, r.runnable, r.switches, r.migrations, r.map_ops, r.map_ns});
+  }
+
+  void Task(const TaskMetrics &t) {
+    if (format_ == kBinary)
+      Put('T', t);
+    else
+      Row("task", {t.id, t.cpu, t.start, t.finish, t.wait});
+  }
+
+  void Histogram(uint32_t cpu, HistogramKind kind, const LatencyHistogram &h) {
+    h.ForEach([&](uint64_t low, uint64_t count) {
+      if (format_ == kBinary)
+        Put('H', BucketRecord{low, count, cpu, kind});
+      else
+        Row(kind == kWaitHistogram ? "wait" : "turnaround", {cpu, low, count});
+    });
+  }
+
+  // Flush the stream and close the file
+  void Close() {
+    bool ok = std::fflush(file_) == 0 && !std::ferror(file_);
+    std::fclose(file_);
+    file_ = nullptr;
+    if (!ok)
+      throw std::runtime_error("Error: cannot write metrics");
+  }
+
+ private:
+  struct Totals {
+    uint64_t switches = 0, migrations = 0, map_ops = 0, map_ns = 0;
+  };
+
+  template <typename R>
+  void Put(char tag, const R &r) {
+    std::fputc(tag, file_);
+    std::fwrite(&r, sizeof(r), 1, file_);
+  }
+
+  void Row(const char *type, std::initializer_list<uint64_t> fields) {
+    char line[256];
+    std::size_t n = std::strlen(type);
+    std::memcpy(line, type, n);
+    for (uint64_t x : fields) {
+      line[n++] = ',';
+      n = std::to_chars(line + n, line + sizeof(line), x).ptr - line;
+    }
+    line[n++] = '\n';
+    std::fwrite(line, 1, n, file_);
+  }
+
+  std::FILE *file_ = nullptr;
+  Format format_;
+  std::vector<char> buffer_;
+  std::vector<Totals> last_;  // per CPU, as of its previous sample
+};
+
+#endif  // CFS_METRICS_H_
@@ -0,0 +1,532 @@
+// CFS scheduler simulator
+// Every simulated CPU owns a runqueue, a Multi_Map keyed by vruntime, and
+// an event queue, a Multi_Map keyed by time. The CPU jumps from event to
+// event (arrival, end of a slice, wakeup), so idle stretches and long
+// slices cost nothing. A picked task runs for its share of the scheduling
+// latency, then is preempted, finishes or goes to sleep; a task arriving
+// far enough behind the running one preempts it early. CPUs are simulated
+// in parallel on worker threads that meet at a barrier every kEpochTicks
+// ticks. At the barrier new arrivals go to the least loaded CPUs, CPUs
+// left with nothing to run steal a task from the busiest, and every
+// kBalanceEpochs epochs the queue lengths are leveled.
+//
+// Usage: cfs_sched [--metrics|--metrics-csv <out_file>] <task_file> [cpus] [threads]
+//        cfs_sched --convert <text_file> <trace_file>
+// The task file is either a binary trace (see cfs_trace.h), which is
+// mapped and streamed, or text whose lines are "<id> <start_tick>
+// <duration>", optionally followed by "<burst> <sleep>": the task then
+// sleeps for <sleep> ticks after every <burst> ticks of running. Convert
+// large text files once; the text form is loaded whole. --metrics
+// streams per-CPU samples, finished tasks and latency histograms to
+// <out_file> in the binary or CSV form described in cfs_metrics.h.
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cfs_metrics.h"
+#include "cfs_trace.h"
+#include "multimap.h"
+
+namespace {
+
+// Ticks the CPUs run independently between barriers
+constexpr uint64_t kEpochTicks = 32;
+// Records consumed between handing trace pages back
+constexpr std::size_t kReleaseRecords = 1 << 16;
+// Epochs between full load balancing passes
+constexpr unsigned kBalanceEpochs = 4;
+// Epochs between metrics samples of every CPU
+constexpr uint64_t kSampleEpochs = 16;
+// Period in which every runnable task should get a slice
+constexpr uint64_t kSchedLatency = 24;
+// Shortest slice, however many tasks share the CPU
+constexpr uint64_t kMinGranularity = 3;
+// Lead in vruntime a newcomer needs to preempt the running task
+constexpr uint64_t kWakeupGranularity = 4;
+
+struct Task {
+  uint32_t id;        // index of its record in the trace, by start
+  uint64_t start;     // arrival tick
+  uint64_t duration;  // ticks of CPU time needed
+  uint64_t burst = 0; // ticks run between sleeps, 0 to never sleep
+  uint64_t sleep = 0; // ticks slept after each burst
+  uint64_t runtime = 0;
+  uint64_t vruntime = 0;
+  uint64_t awake = 0; // ticks run since the last wakeup
+  uint64_t queued = 0; // tick it last became runnable
+  uint64_t waited = 0; // ticks runnable but not running
+};
+
+struct Event {
+  enum Type { kArrival, kSliceEnd, kWake };
+  Type type;
+  uint64_t slice = 0;  // for kSliceEnd, which slice it ends
+  Task task{};         // for kArrival and kWake
+};
+
+// Reusable barrier for a fixed number of threads
+class Barrier {
+ public:
+  explicit Barrier(unsigned count) : count_(count) {}
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    unsigned generation = generation_;
+    if (++arrived_ == count_) {
+      arrived_ = 0;
+      generation_++;
+      cv_.notify_all();
+      return;
+    }
+    cv_.wait(lock, [&] { return generation != generation_; });
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  unsigned count_;
+  unsigned arrived_ = 0;
+  unsigned generation_ = 0;
+};
+
+struct Cpu {
+  Multi_Map<uint64_t, Task> rq;
+  Multi_Map<uint64_t, Event> events;
+  Task current{};
+  bool running = false;
+  uint64_t slice_start = 0;  // tick the current task was picked
+  uint64_t slice = 0;        // id of the current slice; older kSliceEnd are stale
+  // Never decreases; new and migrated tasks start from here
+  uint64_t min_vruntime = 0;
+  unsigned int pending = 0;  // arrivals queued as events
+
+  uint64_t finished = 0;
+  uint64_t turnaround = 0;    // sum of finish - start
+  uint64_t last_finish = 0;
+  uint64_t switches = 0;
+  uint64_t migrations = 0;    // tasks pulled in by balancing
+  uint64_t busy_ticks = 0;
+  CpuMetrics metrics;
+
+  // Tasks this CPU has to run or will soon
+  unsigned int Load() {
+    return rq.Size() + running + pending;
+  }
+
+  // Queue @task to arrive at its start tick
+  void AddArrival(const Task &task);
+  // Process every event before tick @end, starting at tick @begin
+  void Run(uint64_t begin, uint64_t end);
+
+ private:
+  void Enqueue(Task task, uint64_t t);
+  void EndSlice(uint64_t t);
+  void PickNext(uint64_t t);
+  void UpdateMinVruntime();
+};
+
+void Cpu::AddArrival(const Task &task) {
+  Event e{Event::kArrival, 0, task};
+  metrics.Time([&] { events.Emplace(task.start, std::move(e)); });
+  pending++;
+}
+
+void Cpu::Run(uint64_t begin, uint64_t end) {
+  // Balancing may have handed an idle CPU work at the barrier
+  if (!running)
+    PickNext(begin);
+  while (events.Size() > 0) {
+    uint64_t t = metrics.Time([&] { return events.Min(); });
+    if (t >= end)
+      break;
+    Event e = metrics.Time([&] { return events.PopMin(); });
+    switch (e.type) {
+      case Event::kArrival:
+        pending--;
+        e.task.vruntime = min_vruntime;
+        Enqueue(std::move(e.task), t);
+        break;
+      case Event::kWake:
+        // Sleepers come back no further behind than the queue's minimum
+        e.task.vruntime = std::max(e.task.vruntime, min_vruntime);
+        Enqueue(std::move(e.task), t);
+        break;
+      case Event::kSliceEnd:
+        if (e.slice != slice)
+          continue;  // cut short by a preemption
+        EndSlice(t);
+        break;
+    }
+    if (!running)
+      PickNext(t);
+  }
+}
+
+// Make @task runnable at tick @t and preempt the running task if it is
+// far enough ahead
+void Cpu::Enqueue(Task task, uint64_t t) {
+  uint64_t vruntime = task.vruntime;
+  task.queued = t;
+  metrics.Time([&] { rq.Emplace(vruntime, std::move(task)); });
+  if (running && current.vruntime + (t - slice_start) > vruntime + kWakeupGranularity)
+    EndSlice(t);
+}
+
+// Stop the current task at tick @t and decide where it goes next
+void Cpu::EndSlice(uint64_t t) {
+  uint64_t ran = t - slice_start;
+  current.runtime += ran;
+  current.vruntime += ran;
+  current.awake += ran;
+  busy_ticks += ran;
+  running = false;
+  slice++;
+  if (current.runtime == current.duration) {
+    finished++;
+    turnaround += t - current.start;
+    last_finish = t;
+    metrics.turnaround.Record(t - current.start);
+    if (metrics.streaming)
+      metrics.done.push_back({current.start, t, current.waited, current.id, 0});
+  } else if (current.burst && current.awake == current.burst) {
+    current.awake = 0;
+    uint64_t wake = t + current.sleep;
+    Event e{Event::kWake, 0, std::move(current)};
+    metrics.Time([&] { events.Emplace(wake, std::move(e)); });
+  } else {
+    uint64_t key = current.vruntime;
+    current.queued = t;
+    metrics.Time([&] { rq.Emplace(key, std::move(current)); });
+  }
+  UpdateMinVruntime();
+}
+
+// Run the leftmost task from tick @t for its share of the latency period
+void Cpu::PickNext(uint64_t t) {
+  if (rq.Size() == 0)
+    return;
+  current = metrics.Time([&] { return rq.PopMin(); });
+  running = true;
+  switches++;
+  slice_start = t;
+  current.waited += t - current.queued;
+  metrics.wait.Record(t - current.queued);
+  uint64_t length = std::max(kMinGranularity, kSchedLatency / (rq.Size() + 1));
+  length = std::min(length, current.duration - current.runtime);
+  if (current.burst)
+    length = std::min(length, current.burst - current.awake);
+  Event e{Event::kSliceEnd, slice, Task{}};
+  metrics.Time([&] { events.Emplace(t + length, std::move(e)); });
+  UpdateMinVruntime();
+}
+
+void Cpu::UpdateMinVruntime() {
+  uint64_t lowest = running ? current.vruntime : UINT64_MAX;
+  if (rq.Size() > 0)
+    lowest = std::min(lowest, metrics.Time([&] { return rq.Min(); }));
+  if (lowest != UINT64_MAX)
+    min_vruntime = std::max(min_vruntime, lowest);
+}
+
+class Simulator {
+ public:
+  // Simulate the records in [@first, @last), sorted by start; @trace, if
+  // set, is the mapping they live in; @metrics, if set, gets the stream
+  Simulator(const TraceRecord *first, const TraceRecord *last,
+            const TraceReader *trace, unsigned cpus, unsigned threads,
+            MetricsWriter *metrics = nullptr)
+      : first_(first), next_(first), last_(last), released_(first),
+        trace_(trace), cpus_(cpus), threads_(threads), metrics_(metrics) {
+    for (Cpu &cpu : cpus_)
+      cpu.metrics.streaming = metrics_ != nullptr;
+  }
+
+  // Simulate until every task has finished
+  void Run();
+  // Write the summary to @out
+  void Report(std::ostream &out);
+
+ private:
+  void PlaceArrivals(uint64_t end);
+  void Balance(bool idle_only);
+  void Migrate(Cpu &from, Cpu &to);
+  uint64_t Finished();
+  uint64_t NextEvent(uint64_t now);
+  void Collect(uint64_t tick, bool sample);
+
+  const TraceRecord *first_;
+  const TraceRecord *next_;  // first record not handed to a CPU yet
+  const TraceRecord *last_;
+  const TraceRecord *released_;
+  const TraceReader *trace_;
+  std::vector<Cpu> cpus_;
+  unsigned threads_;
+  MetricsWriter *metrics_;
+  uint64_t epochs_ = 0;
+};
+
+// Hand every task arriving before @end to the CPU with the least load
+void Simulator::PlaceArrivals(uint64_t end) {
+  if (next_ == last_ || next_->start >= end)
+    return;
+  Multi_Map<unsigned int, unsigned int> loads;
+  for (unsigned int i = 0; i < cpus_.size(); i++)
+    loads.Insert(cpus_[i].Load(), i);
+  for (; next_ != last_ && next_->start < end; next_++) {
+    Task task;
+    task.id = static_cast<uint32_t>(next_ - first_);
+    task.start = next_->start;
+    task.duration = next_->duration;
+    task.burst = next_->burst;
+    task.sleep = next_->sleep;
+    auto least = loads.begin();
+    unsigned int load = least->first;
+    unsigned int cpu = least->second;
+    cpus_[cpu].AddArrival(task);
+    loads.UpdateKey(load, cpu, load + 1);
+  }
+  // The records are copied out, so their pages can go
+  if (trace_ && next_ - released_ >= static_cast<std::ptrdiff_t>(kReleaseRecords)) {
+    trace_->Release(next_);
+    released_ = next_;
+  }
+}
+
+// Move queued tasks from the busiest CPUs to the idlest. With @idle_only
+// only CPUs with nothing to run pull a task each, as in newly idle
+// balancing; otherwise loads are leveled to within one task.
+void Simulator::Balance(bool idle_only) {
+  Multi_Map<unsigned int, unsigned int> loads;
+  for (unsigned int i = 0; i < cpus_.size(); i++)
+    loads.Insert(cpus_[i].Load(), i);
+  while (true) {
+    unsigned int low = loads.Min();
+    unsigned int high = loads.Max();
+    if (high - low <= 1 || (idle_only && low > 0))
+      break;
+    unsigned int to = loads.Get(low);
+    unsigned int from = loads.Get(high);
+    // Only queued tasks move; the running one and arrivals stay put
+    if (cpus_[from].rq.Size() == 0)
+      break;
+    Migrate(cpus_[from], cpus_[to]);
+    loads.UpdateKey(high, from, high - 1);
+    loads.UpdateKey(low, to, low + 1);
+  }
+}
+
+// Move the task that would wait longest on @from over to @to, keeping its
+// lag behind the queue's min vruntime
+void Simulator::Migrate(Cpu &from, Cpu &to) {
+  uint64_t key = from.rq.Max();
+  Task task = from.rq.Get(key);
+  from.rq.Remove(key);
+  task.vruntime = task.vruntime - from.min_vruntime + to.min_vruntime;
+  uint64_t new_key = task.vruntime;
+  to.rq.Emplace(new_key, std::move(task));
+  to.migrations++;
+}
+
+uint64_t Simulator::Finished() {
+  uint64_t done = 0;
+  for (Cpu &cpu : cpus_)
+    done += cpu.finished;
+  return done;
+}
+
+// Earliest tick from @now on at which anything can happen
+uint64_t Simulator::NextEvent(uint64_t now) {
+  uint64_t next = next_ != last_ ? next_->start : UINT64_MAX;
+  for (Cpu &cpu : cpus_) {
+    // Work handed to an idle CPU starts right away
+    if (!cpu.running && cpu.rq.Size() > 0)
+      return now;
+    if (cpu.events.Size() > 0)
+      next = std::min(next, cpu.events.Min());
+  }
+  return std::max(now, next);
+}
+
+// Write out the tasks finished by @tick and, if @sample, a sample of
+// every CPU; runs at the barrier, while the workers wait
+void Simulator::Collect(uint64_t tick, bool sample) {
+  for (uint32_t i = 0; i < cpus_.size(); i++) {
+    Cpu &cpu = cpus_[i];
+    for (TaskMetrics &t : cpu.metrics.done) {
+      t.cpu = i;
+      metrics_->Task(t);
+    }
+    cpu.metrics.done.clear();
+    if (sample)
+      metrics_->Sample(tick, i, cpu.Load() - cpu.pending, cpu.switches,
+                       cpu.migrations, cpu.metrics);
+  }
+}
+
+void Simulator::Run() {
+  unsigned workers = std::max(1u, std::min<unsigned>(threads_, cpus_.size()));
+  Barrier start(workers + 1);
+  Barrier end(workers + 1);
+  uint64_t now = 0;
+  bool stop = false;
+
+  // Worker w simulates a fixed slice of the CPUs for each epoch
+  std::vector<std::thread> pool;
+  for (unsigned w = 0; w < workers; w++) {
+    pool.emplace_back([&, w] {
+      std::size_t first = cpus_.size() * w / workers;
+      std::size_t last = cpus_.size() * (w + 1) / workers;
+      while (true) {
+        start.Wait();
+        if (stop)
+          return;
+        for (std::size_t c = first; c < last; c++)
+          cpus_[c].Run(now, now + kEpochTicks);
+        end.Wait();
+      }
+    });
+  }
+
+  // The workers only ever wait at start while this thread runs the loop
+  auto shutdown = [&] {
+    stop = true;
+    start.Wait();
+    for (std::thread &t : pool)
+      t.join();
+  };
+  try {
+    while (Finished() < static_cast<uint64_t>(last_ - first_)) {
+      // Skip epochs in which nothing would happen
+      now = NextEvent(now) / kEpochTicks * kEpochTicks;
+      PlaceArrivals(now + kEpochTicks);
+      Balance(++epochs_ % kBalanceEpochs != 0);
+      start.Wait();
+      end.Wait();
+      now += kEpochTicks;
+      if (metrics_)
+        Collect(now, epochs_ % kSampleEpochs == 0);
+    }
+  } catch (...) {
+    // Joinable threads would terminate the process on the way out
+    shutdown();
+    throw;
+  }
+  shutdown();
+
+  if (metrics_) {
+    Collect(now, true);
+    for (uint32_t i = 0; i < cpus_.size(); i++) {
+      metrics_->Histogram(i, kWaitHistogram, cpus_[i].metrics.wait);
+      metrics_->Histogram(i, kTurnaroundHistogram, cpus_[i].metrics.turnaround);
+    }
+    metrics_->Close();
+  }
+}
+
+void Simulator::Report(std::ostream &out) {
+  uint64_t finished = 0, turnaround = 0, makespan = 0;
+  uint64_t switches = 0, migrations = 0, busy = 0;
+  LatencyHistogram wait, turn;
+  for (Cpu &cpu : cpus_) {
+    wait.Merge(cpu.metrics.wait);
+    turn.Merge(cpu.metrics.turnaround);
+    finished += cpu.finished;
+    turnaround += cpu.turnaround;
+    makespan = std::max(makespan, cpu.last_finish);
+    switches += cpu.switches;
+    migrations += cpu.migrations;
+    busy += cpu.busy_ticks;
+  }
+  out << "tasks: " << finished << "\n";
+  out << "cpus: " << cpus_.size() << "\n";
+  out << "makespan: " << makespan << "\n";
+  out << "avg turnaround: "
+      << (finished ? static_cast<double>(turnaround) / finished : 0.0) << "\n";
+  out << "turnaround p50/p99/max: " << turn.Percentile(0.5) << " "
+      << turn.Percentile(0.99) << " " << turn.Max() << "\n";
+  out << "avg wait: " << wait.Mean() << "\n";
+  out << "wait p50/p99/max: " << wait.Percentile(0.5) << " "
+      << wait.Percentile(0.99) << " " << wait.Max() << "\n";
+  out << "utilization: "
+      << (makespan ? static_cast<double>(busy) / (makespan * cpus_.size()) : 0.0)
+      << "\n";
+  out << "context switches: " << switches << "\n";
+  out << "migrations: " << migrations << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && std::string(argv[1]) == "--convert") {
+    try {
+      uint64_t count = ConvertTrace(argv[2], argv[3]);
+      std::cout << "records: " << count << std::endl;
+    } catch (const std::runtime_error &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  const char *metrics_path = nullptr;
+  MetricsWriter::Format metrics_format = MetricsWriter::kBinary;
+  if (argc > 2 && (std::string(argv[1]) == "--metrics" || std::string(argv[1]) == "--metrics-csv")) {
+    if (std::string(argv[1]) == "--metrics-csv")
+      metrics_format = MetricsWriter::kCsv;
+    metrics_path = argv[2];
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc < 2 || argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " [--metrics|--metrics-csv <out_file>] <task_file> [cpus] [threads]\n"
+              << "       " << argv[0] << " --convert <text_file> <trace_file>" << std::endl;
+    return 1;
+  }
+  unsigned cpus = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+  unsigned threads = argc > 3 ? std::strtoul(argv[3], nullptr, 10)
+                              : std::max(1u, std::thread::hardware_concurrency());
+  if (cpus == 0) {
+    std::cerr << "Error: need at least one cpu" << std::endl;
+    return 1;
+  }
+
+  try {
+    std::unique_ptr<TraceReader> trace;
+    std::vector<TraceRecord> records;
+    {
+      MappedFile file(argv[1]);
+      if (TraceReader::IsTrace(file)) {
+        trace.reset(new TraceReader(argv[1]));
+      } else {
+        ParseTextTrace(file.data(), file.data() + file.size(),
+                       [&](const TraceRecord &r) { records.push_back(r); });
+        std::stable_sort(records.begin(), records.end(),
+                         [](const TraceRecord &a, const TraceRecord &b) {
+                           return a.start < b.start;
+                         });
+      }
+    }
+    const TraceRecord *first = trace ? trace->begin() : records.data();
+    const TraceRecord *last = trace ? trace->end() : records.data() + records.size();
+    std::unique_ptr<MetricsWriter> metrics;
+    if (metrics_path)
+      metrics.reset(new MetricsWriter(metrics_path, metrics_format, cpus, kEpochTicks));
+    Simulator sim(first, last, trace.get(), cpus, threads, metrics.get());
+    sim.Run();
+    sim.Report(std::cout);
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
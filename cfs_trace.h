@@ -0,0 +1,247 @@
+#ifndef CFS_TRACE_H_
+#define CFS_TRACE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// Binary task traces for cfs_sched
+// A trace is a TraceHeader followed by fixed-size TraceRecords sorted by
+// start tick, in host byte order. Readers map the file and hand out
+// pointers straight into it, so nothing is parsed or copied up front and
+// the pages already consumed can be given back as the simulation advances.
+
+struct TraceHeader {
+  char magic[8];         // kTraceMagic
+  uint32_t version;      // kTraceVersion
+  uint32_t record_size;  // sizeof(TraceRecord)
+  uint64_t count;        // records that follow
+};
+
+struct TraceRecord {
+  uint64_t start;     // arrival tick
+  uint32_t duration;  // ticks of CPU time needed
+  uint32_t burst;     // ticks run between sleeps, 0 to never sleep
+  uint32_t sleep;     // ticks slept after each burst
+  uint32_t reserved;  // zero
+};
+
+static_assert(sizeof(TraceHeader) == 24, "trace header layout");
+static_assert(sizeof(TraceRecord) == 24, "trace record layout");
+
+constexpr char kTraceMagic[8] = {'C', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t kTraceVersion = 1;
+// Latest start tick a trace may hold, far enough below UINT64_MAX that
+// the simulator can add waits, run times, sleeps and epoch rounding to it
+constexpr uint64_t kMaxTraceStart = uint64_t(1) << 62;
+
+// Read-only mapping of a whole file
+class MappedFile {
+ public:
+  explicit MappedFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error(std::string("Error: cannot open file ") + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error(std::string("Error: cannot stat file ") + path);
+    }
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ > 0) {
+      void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error(std::string("Error: cannot map file ") + path);
+      }
+      data_ = static_cast<const char *>(p);
+      madvise(p, size_, MADV_SEQUENTIAL);
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_)
+      munmap(const_cast<char *>(data_), size_);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+  // Drop the pages wholly before @p; they are read back if touched again
+  void Release(const void *p) const {
+    if (!data_)
+      return;
+    std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t bytes = static_cast<const char *>(p) - data_;
+    bytes -= bytes % page;
+    if (bytes > 0)
+      madvise(const_cast<char *>(data_), bytes, MADV_DONTNEED);
+  }
+
+ private:
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// Sequential view of a mapped binary trace
+class TraceReader {
+ public:
+  explicit TraceReader(const char *path) : file_(path) {
+    if (!IsTrace(file_))
+      throw std::runtime_error(std::string("Error: not a trace file ") + path);
+    const TraceHeader *h = reinterpret_cast<const TraceHeader *>(file_.data());
+    if (h->version != kTraceVersion || h->record_size != sizeof(TraceRecord))
+      throw std::runtime_error("Error: unsupported trace version");
+    if (h->count > (file_.size() - sizeof(TraceHeader)) / sizeof(TraceRecord))
+      throw std::runtime_error("Error: trace is truncated");
+    begin_ = reinterpret_cast<const TraceRecord *>(file_.data() + sizeof(TraceHeader));
+    end_ = begin_ + h->count;
+    // Check the order in one pass up front, so a bad trace fails before
+    // any simulation starts, and hand the pages back until they are needed
+    for (const TraceRecord *r = begin_ + 1; r < end_; r++) {
+      if (r->start < r[-1].start)
+        throw std::runtime_error("Error: trace is not sorted by start");
+    }
+    if (end_ != begin_ && end_[-1].start > kMaxTraceStart)
+      throw std::runtime_error("Error: trace start tick out of range");
+    file_.Release(end_);
+  }
+
+  // Return whether @file starts with a trace header
+  static bool IsTrace(const MappedFile &file) {
+    return file.size() >= sizeof(TraceHeader) &&
+           std::memcmp(file.data(), kTraceMagic, sizeof(kTraceMagic)) == 0;
+  }
+
+  const TraceRecord *begin() const { return begin_; }
+  const TraceRecord *end() const { return end_; }
+  uint64_t size() const { return end_ - begin_; }
+  // Give back the pages of the records before @upto
+  void Release(const TraceRecord *upto) const { file_.Release(upto); }
+
+ private:
+  MappedFile file_;
+  const TraceRecord *begin_;
+  const TraceRecord *end_;
+};
+
+// Parse "<id> <start> <duration> [<burst> <sleep>]" lines in [@p, @end)
+// and call @f with each record; lines that do not parse or have a zero
+// duration are skipped, and a field too large for its record field or a
+// start above kMaxTraceStart throws
+template <typename F>
+void ParseTextTrace(const char *p, const char *end, F f) {
+  uint64_t line = 0;
+  auto fail = [&](const char *what) {
+    throw std::runtime_error("Error: line " + std::to_string(line) + ": " + what);
+  };
+  auto blank = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+  // Read one unsigned field before @lim, skipping leading blanks
+  auto number = [&](const char *&q, const char *lim, uint64_t &out) {
+    while (q < lim && blank(*q)) q++;
+    if (q == lim || *q < '0' || *q > '9')
+      return false;
+    out = 0;
+    while (q < lim && *q >= '0' && *q <= '9') {
+      unsigned digit = *q++ - '0';
+      if (out > (UINT64_MAX - digit) / 10)
+        fail("number out of range");
+      out = out * 10 + digit;
+    }
+    return true;
+  };
+
+  while (p < end) {
+    line++;
+    const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (!eol)
+      eol = end;
+    const char *q = p;
+    // Skip the id
+    while (q < eol && blank(*q)) q++;
+    while (q < eol && !blank(*q)) q++;
+    uint64_t start, duration, burst = 0, sleep = 0;
+    bool ok = number(q, eol, start) && number(q, eol, duration);
+    if (ok && !(number(q, eol, burst) && number(q, eol, sleep)))
+      burst = sleep = 0;
+    if (ok && duration > 0) {
+      if (duration > UINT32_MAX || burst > UINT32_MAX || sleep > UINT32_MAX)
+        fail("duration, burst or sleep does not fit in 32 bits");
+      if (start > kMaxTraceStart)
+        fail("start tick out of range");
+      TraceRecord r{start, static_cast<uint32_t>(duration),
+                    static_cast<uint32_t>(burst), static_cast<uint32_t>(sleep), 0};
+      f(r);
+    }
+    p = eol + 1;
+  }
+}
+
+// Convert the text trace at @text_path into a binary trace at @trace_path,
+// sorting by start if needed, and return the number of records written
+inline uint64_t ConvertTrace(const char *text_path, const char *trace_path) {
+  MappedFile text(text_path);
+  FILE *out = std::fopen(trace_path, "w+b");
+  if (!out)
+    throw std::runtime_error(std::string("Error: cannot create file ") + trace_path);
+  static char buffer[1 << 20];
+  std::setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+
+  // The magic goes in last, so a conversion cut short by a bad line or a
+  // failed write, a full disk say, never leaves a file that reads as a trace
+  TraceHeader header{};
+  header.version = kTraceVersion;
+  header.record_size = sizeof(TraceRecord);
+  bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+
+  bool sorted = true;
+  uint64_t last = 0;
+  try {
+    ParseTextTrace(text.data(), text.data() + text.size(), [&](const TraceRecord &r) {
+      sorted = sorted && r.start >= last;
+      last = r.start;
+      ok = std::fwrite(&r, sizeof(r), 1, out) == 1 && ok;
+      header.count++;
+    });
+  } catch (...) {
+    std::fclose(out);
+    throw;
+  }
+  std::memcpy(header.magic, kTraceMagic, sizeof(kTraceMagic));
+  ok = ok && std::fseek(out, 0, SEEK_SET) == 0;
+  ok = ok && std::fwrite(&header, sizeof(header), 1, out) == 1;
+  ok = std::fflush(out) == 0 && !std::ferror(out) && ok;
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok)
+    throw std::runtime_error(std::string("Error: cannot write file ") + trace_path);
+  if (sorted || header.count == 0)
+    return header.count;
+
+  // Out of order input: sort the records in place through a shared mapping
+  int fd = open(trace_path, O_RDWR);
+  std::size_t size = sizeof(TraceHeader) + header.count * sizeof(TraceRecord);
+  void *p = fd < 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (p == MAP_FAILED)
+    throw std::runtime_error(std::string("Error: cannot map file ") + trace_path);
+  TraceRecord *records = reinterpret_cast<TraceRecord *>(static_cast<char *>(p) + sizeof(TraceHeader));
+  std::stable_sort(records, records + header.count,
+                   [](const TraceRecord &a, const TraceRecord &b) { return a.start < b.start; });
+  munmap(p, size);
+  return header.count;
+}
+
+#endif  // CFS_TRACE_H_
@@ -0,0 +1,222 @@
+#ifndef CONCURRENT_MULTI_MAP_H_
+#define CONCURRENT_MULTI_MAP_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "multimap.h"
+
+// Thread-safe Multi_Map for many readers and a few writers
+// Keys are spread over shards by hash. Each shard keeps two copies of its
+// tree under the Left-Right scheme: readers announce themselves on a read
+// indicator and use whichever copy is live without taking a lock, while
+// the shard's writer updates the idle copy, swaps, waits for readers of
+// the old copy to leave and replays the change there. Readers never block
+// and writers only contend with writers of the same shard, at the cost of
+// keeping every entry twice.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class ConcurrentMulti_Map {
+ public:
+  // Constructor, @shards bounds how many writers can run at once
+  explicit ConcurrentMulti_Map(unsigned int shards = 64)
+      : shards_(new Shard[shards ? shards : 1]), num_shards_(shards ? shards : 1) {}
+
+  ConcurrentMulti_Map(const ConcurrentMulti_Map &) = delete;
+  ConcurrentMulti_Map &operator=(const ConcurrentMulti_Map &) = delete;
+
+  // Return size of map
+  unsigned int Size();
+  // Return a copy of the first value associated to @key
+  V Get(const K &key);
+  // Return whether @key is found in map
+  bool Contains(const K &key);
+  // Return a copy of the max key in map
+  K Max();
+  // Return a copy of the min key in map
+  K Min();
+  // Insert @value under @key
+  void Insert(const K &key, const V &value);
+  // Remove the first value of @key, return whether anything was removed
+  bool Remove(const K &key);
+  // Remove the first occurrence of @value under @key
+  bool Erase(const K &key, const V &value);
+  // Remove every key
+  void Clear();
+
+ private:
+  // Counts readers inside one version, striped so that readers on
+  // different cores touch different cache lines
+  class ReadIndicator {
+   public:
+    static constexpr unsigned kStripes = 32;
+    void Arrive(unsigned s) { slots_[s].n.fetch_add(1); }
+    void Depart(unsigned s) { slots_[s].n.fetch_sub(1); }
+    bool Empty() const {
+      for (const Slot &slot : slots_)
+        if (slot.n.load() != 0) return false;
+      return true;
+    }
+
+   private:
+    struct alignas(64) Slot {
+      std::atomic<int> n{0};
+    };
+    Slot slots_[kStripes];
+  };
+
+  struct Shard {
+    Multi_Map<K, V> maps[2];
+    std::atomic<int> live{0};     // copy readers use
+    std::atomic<int> version{0};  // indicator new readers arrive on
+    ReadIndicator readers[2];
+    std::atomic<unsigned int> size{0};
+    std::mutex write_mutex;
+  };
+
+  // Stripe of the calling thread, fixed for its lifetime
+  static unsigned Stripe() {
+    thread_local unsigned stripe =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) %
+        ReadIndicator::kStripes;
+    return stripe;
+  }
+
+  Shard &ShardFor(const K &key) {
+    // Fold the hash so identity hashes of small keys still spread out
+    uint64_t h = static_cast<uint64_t>(Hash()(key)) * 0x9E3779B97F4A7C15ull;
+    return shards_[(h >> 32) % num_shards_];
+  }
+
+  template <typename F>
+  auto Read(Shard &s, F f);
+  template <typename F>
+  auto Write(Shard &s, F f);
+
+  std::unique_ptr<Shard[]> shards_;
+  unsigned int num_shards_;
+};
+
+// Run @f on the live copy of @s; wait-free apart from @f itself
+template <typename K, typename V, typename H>
+template <typename F>
+auto ConcurrentMulti_Map<K, V, H>::Read(Shard &s, F f) {
+  unsigned stripe = Stripe();
+  int version = s.version.load();
+  s.readers[version].Arrive(stripe);
+  // Leave the indicator even if @f throws
+  struct Departure {
+    ReadIndicator &indicator;
+    unsigned stripe;
+    ~Departure() { indicator.Depart(stripe); }
+  } departure{s.readers[version], stripe};
+  return f(s.maps[s.live.load()]);
+}
+
+// Apply @f to both copies of @s, one at a time, and return the first result
+template <typename K, typename V, typename H>
+template <typename F>
+auto ConcurrentMulti_Map<K, V, H>::Write(Shard &s, F f) {
+  std::lock_guard<std::mutex> lock(s.write_mutex);
+  int live = s.live.load();
+  auto result = f(s.maps[1 - live]);
+  s.live.store(1 - live);
+
+  // Readers that arrived before the swap may still be on the old copy;
+  // toggle the version and drain both indicators before touching it
+  int prev = s.version.load();
+  int next = 1 - prev;
+  while (!s.readers[next].Empty()) std::this_thread::yield();
+  s.version.store(next);
+  while (!s.readers[prev].Empty()) std::this_thread::yield();
+
+  f(s.maps[live]);
+  s.size.store(s.maps[live].Size());
+  return result;
+}
+
+template <typename K, typename V, typename H>
+unsigned int ConcurrentMulti_Map<K, V, H>::Size() {
+  unsigned int total = 0;
+  for (unsigned int i = 0; i < num_shards_; i++)
+    total += shards_[i].size.load(std::memory_order_relaxed);
+  return total;
+}
+
+template <typename K, typename V, typename H>
+V ConcurrentMulti_Map<K, V, H>::Get(const K &key) {
+  return Read(ShardFor(key), [&](Multi_Map<K, V> &m) -> V { return m.Get(key); });
+}
+
+template <typename K, typename V, typename H>
+bool ConcurrentMulti_Map<K, V, H>::Contains(const K &key) {
+  return Read(ShardFor(key), [&](Multi_Map<K, V> &m) { return m.Contains(key); });
+}
+
+template <typename K, typename V, typename H>
+K ConcurrentMulti_Map<K, V, H>::Max() {
+  std::optional<K> best;
+  for (unsigned int i = 0; i < num_shards_; i++) {
+    Read(shards_[i], [&](Multi_Map<K, V> &m) {
+      if (m.Size() && (!best || *best < m.Max()))
+        best = m.Max();
+      return 0;
+    });
+  }
+  if (!best)
+    throw std::runtime_error("Error: tree is empty");
+  return *best;
+}
+
+template <typename K, typename V, typename H>
+K ConcurrentMulti_Map<K, V, H>::Min() {
+  std::optional<K> best;
+  for (unsigned int i = 0; i < num_shards_; i++) {
+    // Each tree caches its min, so this is one load per shard
+    Read(shards_[i], [&](Multi_Map<K, V> &m) {
+      if (m.Size() && (!best || m.Min() < *best))
+        best = m.Min();
+      return 0;
+    });
+  }
+  if (!best)
+    throw std::runtime_error("Error: tree is empty");
+  return *best;
+}
+
+template <typename K, typename V, typename H>
+void ConcurrentMulti_Map<K, V, H>::Insert(const K &key, const V &value) {
+  Write(ShardFor(key), [&](Multi_Map<K, V> &m) {
+    m.Insert(key, value);
+    return 0;
+  });
+}
+
+template <typename K, typename V, typename H>
+bool ConcurrentMulti_Map<K, V, H>::Remove(const K &key) {
+  return Write(ShardFor(key), [&](Multi_Map<K, V> &m) { return m.Remove(key); });
+}
+
+template <typename K, typename V, typename H>
+bool ConcurrentMulti_Map<K, V, H>::Erase(const K &key, const V &value) {
+  return Write(ShardFor(key), [&](Multi_Map<K, V> &m) { return m.Erase(key, value); });
+}
+
+template <typename K, typename V, typename H>
+void ConcurrentMulti_Map<K, V, H>::Clear() {
+  for (unsigned int i = 0; i < num_shards_; i++) {
+    Write(shards_[i], [](Multi_Map<K, V> &m) {
+      m.Clear();
+      return 0;
+    });
+  }
+}
+
+#endif  // CONCURRENT_MULTI_MAP_H_
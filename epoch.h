@@ -0,0 +1,128 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Epoch-based reclamation for lock-free structures
+// A thread pins the current epoch for as long as it may hold pointers
+// into a shared structure. Memory unlinked from it is retired rather than
+// freed and only released once every pinned thread has moved two epochs
+// past the retirement, so no reader can still see it. Thread records are
+// created on first use, reused after their thread exits and never freed.
+class Epoch {
+ public:
+  // Keeps the calling thread pinned while in scope; guards nest
+  class Guard {
+   public:
+    Guard() { Epoch::Enter(); }
+    ~Guard() { Epoch::Exit(); }
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+  };
+
+  // Hand @p to be released with @deleter once no thread can reach it;
+  // the caller must be pinned and @p already unlinked
+  static void Retire(void *p, void (*deleter)(void *)) {
+    Record *r = Local().record;
+    uint64_t epoch = global_epoch_.load();
+    Limbo &limbo = r->limbo[epoch % 3];
+    if (limbo.epoch != epoch) {
+      Free(limbo);
+      limbo.epoch = epoch;
+    }
+    limbo.items.push_back({p, deleter});
+    if (++r->retired % kAdvanceEvery == 0)
+      TryAdvance();
+  }
+
+ private:
+  // Retirements between attempts to move the global epoch
+  static constexpr unsigned kAdvanceEvery = 64;
+
+  struct Retired {
+    void *p;
+    void (*deleter)(void *);
+  };
+  struct Limbo {
+    uint64_t epoch = 0;
+    std::vector<Retired> items;
+  };
+  struct alignas(64) Record {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> active{false};
+    std::atomic<bool> in_use{true};
+    Record *next = nullptr;
+    unsigned depth = 0;  // nested guards
+    unsigned retired = 0;
+    Limbo limbo[3];
+  };
+
+  // Claims a record for the thread and gives it back when the thread exits;
+  // whatever is still in limbo is released by the next owner
+  struct Owner {
+    Record *record;
+    Owner() : record(Acquire()) {}
+    ~Owner() { record->in_use.store(false); }
+  };
+
+  static Owner &Local() {
+    thread_local Owner owner;
+    return owner;
+  }
+
+  static Record *Acquire() {
+    for (Record *r = records_.load(); r; r = r->next) {
+      bool free = false;
+      if (!r->in_use.load() && r->in_use.compare_exchange_strong(free, true))
+        return r;
+    }
+    Record *r = new Record();
+    r->next = records_.load();
+    while (!records_.compare_exchange_weak(r->next, r)) {
+    }
+    return r;
+  }
+
+  static void Enter() {
+    Record *r = Local().record;
+    if (r->depth++ > 0)
+      return;
+    r->active.store(true);
+    // Publishing the epoch after going active means an advancing thread
+    // either sees us active or we see its new epoch
+    uint64_t epoch = global_epoch_.load();
+    r->epoch.store(epoch);
+    // Both older buckets are at least two epochs behind now
+    for (Limbo &limbo : r->limbo)
+      if (limbo.epoch + 2 <= epoch)
+        Free(limbo);
+  }
+
+  static void Exit() {
+    Record *r = Local().record;
+    if (--r->depth == 0)
+      r->active.store(false);
+  }
+
+  // Move the epoch on if every pinned thread has caught up with it
+  static void TryAdvance() {
+    uint64_t epoch = global_epoch_.load();
+    for (Record *r = records_.load(); r; r = r->next)
+      if (r->active.load() && r->epoch.load() != epoch)
+        return;
+    global_epoch_.compare_exchange_strong(epoch, epoch + 1);
+  }
+
+  static void Free(Limbo &limbo) {
+    for (const Retired &item : limbo.items)
+      item.deleter(item.p);
+    limbo.items.clear();
+  }
+
+  static inline std::atomic<uint64_t> global_epoch_{2};
+  static inline std::atomic<Record *> records_{nullptr};
+};
+
+#endif  // EPOCH_H_
@@ -0,0 +1,141 @@
+#ifndef FORK_JOIN_H_
+#define FORK_JOIN_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads for fork-join recursion
+// Invoke runs one half of a fork on the calling thread and queues the
+// other; while it waits for that half it runs queued tasks itself, so
+// nested forks never leave a thread blocked on work nobody will pick up.
+// Workers take the oldest, and so largest, task first; a waiting caller
+// takes the newest, usually its own.
+class ForkJoinPool {
+ public:
+  explicit ForkJoinPool(unsigned workers) {
+    for (unsigned i = 0; i < workers; i++)
+      workers_.emplace_back([this] { Work(); });
+  }
+
+  ~ForkJoinPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread &t : workers_)
+      t.join();
+  }
+
+  ForkJoinPool(const ForkJoinPool &) = delete;
+  ForkJoinPool &operator=(const ForkJoinPool &) = delete;
+
+  // Return a pool with one worker per hardware thread beyond the caller's
+  static ForkJoinPool &Default() {
+    static ForkJoinPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+  }
+
+  // Return the number of worker threads
+  unsigned Workers() const { return static_cast<unsigned>(workers_.size()); }
+
+  // Run @a and @b, possibly at the same time, and return once both are
+  // done; an exception from either is rethrown here
+  template <typename A, typename B>
+  void Invoke(A &&a, B &&b);
+
+ private:
+  struct Task {
+    void (*run)(void *);
+    void *arg;
+    std::atomic<bool> done{false};
+    std::exception_ptr error;
+  };
+
+  void Execute(Task *t) {
+    try {
+      t->run(t->arg);
+    } catch (...) {
+      t->error = std::current_exception();
+    }
+    t->done.store(true, std::memory_order_release);
+  }
+
+  // Run the newest queued task here, return false if there was none
+  bool RunOne() {
+    Task *t;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (queue_.empty())
+        return false;
+      t = queue_.back();
+      queue_.pop_back();
+    }
+    Execute(t);
+    return true;
+  }
+
+  void Work() {
+    while (true) {
+      Task *t;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+        if (queue_.empty())
+          return;
+        t = queue_.front();
+        queue_.pop_front();
+      }
+      Execute(t);
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Task *> queue_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+template <typename A, typename B>
+void ForkJoinPool::Invoke(A &&a, B &&b) {
+  if (workers_.empty()) {
+    a();
+    b();
+    return;
+  }
+  using BFn = typename std::remove_reference<B>::type;
+  Task task;
+  task.run = [](void *f) { (*static_cast<BFn *>(f))(); };
+  task.arg = const_cast<void *>(static_cast<const void *>(&b));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(&task);
+  }
+  cv_.notify_one();
+
+  std::exception_ptr error;
+  try {
+    a();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  // Help out until @b is done, most likely by running it right here
+  while (!task.done.load(std::memory_order_acquire)) {
+    if (!RunOne())
+      std::this_thread::yield();
+  }
+  if (error)
+    std::rethrow_exception(error);
+  if (task.error)
+    std::rethrow_exception(task.error);
+}
+
+#endif  // FORK_JOIN_H_
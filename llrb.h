@@ -0,0 +1,83 @@
+#ifndef LLRB_H_
+#define LLRB_H_
+
+// Balancing steps of a left-leaning red-black tree, shared by the trees
+// that link their nodes in different ways
+// @Tree provides:
+//   Link                       node handle, Tree::kNil for none
+//   LeftOf(n), RightOf(n)      references to the child links of @n
+//   ColorOf(n), SetColorOf(n, c)
+//   Rotated(prt, chd, left)    @chd just took the place of @prt, which is
+//                              now its left child if @left, else its right
+//   Flipped(n), FixingUp(n)    notice of each color flip and fix up
+// Everything is constexpr, so a tree whose hooks are can balance itself
+// during constant evaluation.
+template <typename Tree>
+struct LLRB {
+  using Link = typename Tree::Link;
+  static constexpr bool kRed = false;
+  static constexpr bool kBlack = true;
+
+  static constexpr bool IsRed(Tree &t, Link n) {
+    return n != Tree::kNil && t.ColorOf(n) == kRed;
+  }
+
+  static constexpr void FlipColors(Tree &t, Link n) {
+    t.Flipped(n);
+    t.SetColorOf(n, !t.ColorOf(n));
+    t.SetColorOf(t.LeftOf(n), !t.ColorOf(t.LeftOf(n)));
+    t.SetColorOf(t.RightOf(n), !t.ColorOf(t.RightOf(n)));
+  }
+
+  static constexpr void RotateRight(Tree &t, Link &prt) {
+    Link chd = t.LeftOf(prt);
+    t.LeftOf(prt) = t.RightOf(chd);
+    t.RightOf(chd) = prt;
+    t.SetColorOf(chd, t.ColorOf(prt));
+    t.SetColorOf(prt, kRed);
+    t.Rotated(prt, chd, false);
+    prt = chd;
+  }
+
+  static constexpr void RotateLeft(Tree &t, Link &prt) {
+    Link chd = t.RightOf(prt);
+    t.RightOf(prt) = t.LeftOf(chd);
+    t.LeftOf(chd) = prt;
+    t.SetColorOf(chd, t.ColorOf(prt));
+    t.SetColorOf(prt, kRed);
+    t.Rotated(prt, chd, true);
+    prt = chd;
+  }
+
+  static constexpr void FixUp(Tree &t, Link &n) {
+    t.FixingUp(n);
+    // Rotate left if there is a right-leaning red node
+    if (IsRed(t, t.RightOf(n)) && !IsRed(t, t.LeftOf(n)))
+      RotateLeft(t, n);
+    // Rotate right if red-red pair of nodes on left
+    if (IsRed(t, t.LeftOf(n)) && IsRed(t, t.LeftOf(t.LeftOf(n))))
+      RotateRight(t, n);
+    // Recoloring if both children are red
+    if (IsRed(t, t.LeftOf(n)) && IsRed(t, t.RightOf(n)))
+      FlipColors(t, n);
+  }
+
+  static constexpr void MoveRedRight(Tree &t, Link &n) {
+    FlipColors(t, n);
+    if (IsRed(t, t.LeftOf(t.LeftOf(n)))) {
+      RotateRight(t, n);
+      FlipColors(t, n);
+    }
+  }
+
+  static constexpr void MoveRedLeft(Tree &t, Link &n) {
+    FlipColors(t, n);
+    if (IsRed(t, t.LeftOf(t.RightOf(n)))) {
+      RotateRight(t, t.RightOf(n));
+      RotateLeft(t, n);
+      FlipColors(t, n);
+    }
+  }
+};
+
+#endif  // LLRB_H_
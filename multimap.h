@@ -2,44 +2,633 @@
 #define MULTI_MAP_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <new>
 #include <sstream>
+#include <string>
+#include <type_traits>
 #include <utility>
 #include <map>
+#include <vector>
 #include <stdexcept> // For std::runtime_error
 
+#include "fork_join.h"
+#include "llrb.h"
+#include "multimap_io.h"
+
+// Hint that the cache line at @p is about to be read
+#if defined(__GNUC__)
+#define MULTI_MAP_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define MULTI_MAP_PREFETCH(p) ((void)(p))
+#endif
+
+
+// Slab allocator for fixed-size tree nodes
+// Slots are carved out of contiguous chunks; freed slots go on an intrusive
+// free list and are handed out again before a new chunk is requested.
+template <typename T>
+class NodePool {
+ public:
+  explicit NodePool(std::size_t first_chunk = 64)
+      : next_chunk_(first_chunk ? first_chunk : 1) {}
+  ~NodePool() { Release(); }
+
+  NodePool(const NodePool &) = delete;
+  NodePool &operator=(const NodePool &) = delete;
+
+  // Construct a T in a recycled or fresh slot
+  template <typename... Args>
+  T* New(Args&&... args);
+  // Destroy @p and put its slot on the free list
+  void Delete(T *p);
+  // Drop every chunk at once; live objects must already be destroyed
+  void Release();
+  // Take over every chunk of @other, live objects included, leaving it
+  // empty; its spare slots are threaded onto our free list
+  void Absorb(NodePool &other);
+
+ private:
+  union Slot {
+    Slot *next;
+    alignas(T) unsigned char storage[sizeof(T)];
+  };
+  // Chunks double in size up to this many slots
+  static constexpr std::size_t kMaxChunk = 1 << 16;
+
+  Slot* Allocate();
+
+  std::vector<Slot*> chunks_;
+  Slot *free_ = nullptr;        // recycled slots
+  Slot *bump_ = nullptr;        // next untouched slot in the newest chunk
+  Slot *bump_end_ = nullptr;
+  std::size_t next_chunk_;
+};
+
+template <typename T>
+typename NodePool<T>::Slot* NodePool<T>::Allocate() {
+  if (free_) {
+    Slot *s = free_;
+    free_ = s->next;
+    return s;
+  }
+  if (bump_ == bump_end_) {
+    Slot *chunk = new Slot[next_chunk_];
+    chunks_.push_back(chunk);
+    bump_ = chunk;
+    bump_end_ = chunk + next_chunk_;
+    next_chunk_ = std::min(next_chunk_ * 2, kMaxChunk);
+  }
+  return bump_++;
+}
+
+template <typename T>
+template <typename... Args>
+T* NodePool<T>::New(Args&&... args) {
+  Slot *s = Allocate();
+  try {
+    return ::new (static_cast<void*>(s->storage)) T(std::forward<Args>(args)...);
+  } catch (...) {
+    s->next = free_;
+    free_ = s;
+    throw;
+  }
+}
+
+template <typename T>
+void NodePool<T>::Delete(T *p) {
+  p->~T();
+  Slot *s = reinterpret_cast<Slot*>(p);
+  s->next = free_;
+  free_ = s;
+}
+
+template <typename T>
+void NodePool<T>::Release() {
+  for (Slot *chunk : chunks_)
+    delete[] chunk;
+  chunks_.clear();
+  free_ = bump_ = bump_end_ = nullptr;
+}
+
+template <typename T>
+void NodePool<T>::Absorb(NodePool &other) {
+  chunks_.insert(chunks_.end(), other.chunks_.begin(), other.chunks_.end());
+  // Keep bumping through the larger untouched range, recycle the other
+  if (other.bump_end_ - other.bump_ > bump_end_ - bump_) {
+    std::swap(bump_, other.bump_);
+    std::swap(bump_end_, other.bump_end_);
+  }
+  for (Slot *s = other.bump_; s != other.bump_end_; ++s) {
+    s->next = free_;
+    free_ = s;
+  }
+  while (Slot *s = other.free_) {
+    other.free_ = s->next;
+    s->next = free_;
+    free_ = s;
+  }
+  next_chunk_ = std::max(next_chunk_, other.next_chunk_);
+  other.chunks_.clear();
+  other.free_ = other.bump_ = other.bump_end_ = nullptr;
+}
+
+
+// Per-key list of values kept in insertion order
+// A ring buffer whose first N slots live inside the object, so a key with
+// only a few values needs no heap allocation and FIFO pops are O(1). Once
+// spilled, the capacity is kept in a header in front of the heap buffer,
+// leaving just the head and size beside the slots.
+template <typename V, unsigned N>
+class ValueList {
+  static_assert(N > 0, "ValueList needs at least one inline slot");
+
+ public:
+  class iterator {
+   public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = V;
+    using difference_type = std::ptrdiff_t;
+    using pointer = V*;
+    using reference = V&;
+
+    iterator(ValueList *list, uint32_t i) : list_(list), i_(i) {}
+    V& operator*() const { return (*list_)[i_]; }
+    V* operator->() const { return &(*list_)[i_]; }
+    iterator& operator++() { i_++; return *this; }
+    iterator operator++(int) { iterator t = *this; i_++; return t; }
+    iterator& operator--() { i_--; return *this; }
+    iterator operator--(int) { iterator t = *this; i_--; return t; }
+    bool operator==(const iterator &o) const { return i_ == o.i_ && list_ == o.list_; }
+    bool operator!=(const iterator &o) const { return !(*this == o); }
+    uint32_t index() const { return i_; }
+
+   private:
+    ValueList *list_;
+    uint32_t i_;
+  };
+
+  ValueList() : head_(0), on_heap_(0) {}
+  ValueList(const ValueList &other);
+  ValueList(ValueList &&other) noexcept;
+  ValueList &operator=(ValueList other) noexcept;
+  ~ValueList();
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  V& operator[](std::size_t i) { return data()[Slot(i)]; }
+  V& front() { return data()[head_]; }
+  V& back() { return data()[Slot(size_ - 1)]; }
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, size_); }
+
+  // Construct a value at the back of the list
+  template <typename... Args>
+  V& emplace_back(Args&&... args);
+  void push_back(const V &value) { emplace_back(value); }
+  void push_back(V &&value) { emplace_back(std::move(value)); }
+  // Drop the first value in O(1)
+  void pop_front();
+  // Drop the value at @it, shifting whichever side is shorter
+  void erase(iterator it);
+  // Drop every value; keeps any heap buffer
+  void clear();
+
+ private:
+  // Bytes in front of a heap buffer, holding its capacity
+  static constexpr std::size_t kHeader =
+      alignof(V) > sizeof(uint32_t) ? alignof(V) : sizeof(uint32_t);
+
+  bool IsInline() const { return !on_heap_; }
+  V* data() { return IsInline() ? reinterpret_cast<V*>(inline_) : heap_; }
+  uint32_t Capacity() const {
+    return IsInline() ? N : *reinterpret_cast<const uint32_t*>(
+                                reinterpret_cast<const char*>(heap_) - kHeader);
+  }
+  uint32_t Slot(std::size_t i) const {
+    std::size_t s = head_ + i;
+    uint32_t cap = Capacity();
+    return static_cast<uint32_t>(s >= cap ? s - cap : s);
+  }
+  static V* Allocate(uint32_t cap);
+  static void Free(V *buf);
+  void Grow();
+
+  union {
+    alignas(V) unsigned char inline_[N * sizeof(V)];
+    V *heap_;
+  };
+  uint32_t head_ : 31;     // ring slot of the first value, below Capacity()
+  uint32_t on_heap_ : 1;   // values live in heap_
+  uint32_t size_ = 0;
+};
+
+// Heap buffer for @cap values behind a header recording @cap
+template <typename V, unsigned N>
+V* ValueList<V, N>::Allocate(uint32_t cap) {
+  char *raw = static_cast<char*>(::operator new(kHeader + sizeof(V) * cap));
+  *reinterpret_cast<uint32_t*>(raw) = cap;
+  return reinterpret_cast<V*>(raw + kHeader);
+}
+
+template <typename V, unsigned N>
+void ValueList<V, N>::Free(V *buf) {
+  ::operator delete(reinterpret_cast<char*>(buf) - kHeader);
+}
+
+template <typename V, unsigned N>
+ValueList<V, N>::ValueList(const ValueList &other) : ValueList() {
+  if (other.size_ > N) {
+    heap_ = Allocate(other.size_);
+    on_heap_ = 1;
+  }
+  // Delegating made us constructed already, so should a copy throw, the
+  // destructor runs and frees what was copied so far
+  ValueList &src = const_cast<ValueList&>(other);
+  for (uint32_t i = 0; i < other.size_; i++)
+    emplace_back(src[i]);
+}
+
+template <typename V, unsigned N>
+ValueList<V, N>::ValueList(ValueList &&other) noexcept : ValueList() {
+  if (!other.IsInline()) {
+    // Steal the heap buffer
+    heap_ = other.heap_;
+    on_heap_ = 1;
+    head_ = other.head_;
+    size_ = other.size_;
+    other.on_heap_ = 0;
+    other.head_ = 0;
+    other.size_ = 0;
+    return;
+  }
+  for (uint32_t i = 0; i < other.size_; i++)
+    emplace_back(std::move(other[i]));
+  other.clear();
+}
+
+template <typename V, unsigned N>
+ValueList<V, N> &ValueList<V, N>::operator=(ValueList other) noexcept {
+  this->~ValueList();
+  ::new (static_cast<void*>(this)) ValueList(std::move(other));
+  return *this;
+}
+
+template <typename V, unsigned N>
+ValueList<V, N>::~ValueList() {
+  clear();
+  if (!IsInline())
+    Free(heap_);
+}
+
+template <typename V, unsigned N>
+void ValueList<V, N>::Grow() {
+  uint32_t cap = Capacity();
+  if (cap > (uint32_t(1) << 30))
+    throw std::runtime_error("Error: too many values for one key");
+  V *buf = Allocate(cap * 2);
+  V *old = data();
+  // Unroll the ring so the new buffer starts at slot 0
+  for (uint32_t i = 0; i < size_; i++) {
+    V &v = old[Slot(i)];
+    ::new (static_cast<void*>(buf + i)) V(std::move(v));
+    v.~V();
+  }
+  if (!IsInline())
+    Free(heap_);
+  heap_ = buf;
+  on_heap_ = 1;
+  head_ = 0;
+}
+
+template <typename V, unsigned N>
+template <typename... Args>
+V& ValueList<V, N>::emplace_back(Args&&... args) {
+  if (size_ == Capacity())
+    Grow();
+  V *slot = data() + Slot(size_);
+  ::new (static_cast<void*>(slot)) V(std::forward<Args>(args)...);
+  size_++;
+  return *slot;
+}
+
+template <typename V, unsigned N>
+void ValueList<V, N>::pop_front() {
+  data()[head_].~V();
+  head_ = Slot(1);
+  if (--size_ == 0)
+    head_ = 0;
+}
+
+template <typename V, unsigned N>
+void ValueList<V, N>::erase(iterator it) {
+  uint32_t i = it.index();
+  if (i < size_ / 2) {
+    // Shift the front part one slot right, then drop the head
+    for (uint32_t j = i; j > 0; j--)
+      (*this)[j] = std::move((*this)[j - 1]);
+    pop_front();
+  } else {
+    for (uint32_t j = i; j + 1 < size_; j++)
+      (*this)[j] = std::move((*this)[j + 1]);
+    back().~V();
+    if (--size_ == 0)
+      head_ = 0;
+  }
+}
+
+template <typename V, unsigned N>
+void ValueList<V, N>::clear() {
+  for (uint32_t i = 0; i < size_; i++)
+    (*this)[i].~V();
+  head_ = 0;
+  size_ = 0;
+}
+
+
+// Open-addressing index from key to tree node, for exact-match lookups
+// Linear probing over (hash, node) slots, so a probe usually touches one
+// cache line and only dereferences a node whose full hash matched. Erase
+// shifts the rest of the run back instead of leaving tombstones.
+template <typename K, typename Node, typename Hash = std::hash<K>>
+class NodeIndex {
+ public:
+  NodeIndex() = default;
+  NodeIndex(const NodeIndex &) = delete;
+  NodeIndex &operator=(const NodeIndex &) = delete;
+
+  // Return the node holding @key, nullptr if none
+  Node* Find(const K &key) const;
+  // Start loading the slot a Find for @key probes first
+  void Prefetch(const K &key) const {
+    if (size_ > 0)
+      MULTI_MAP_PREFETCH(&slots_[Home(Mix(key))]);
+  }
+  // Add @n, whose key must not be indexed yet
+  void Insert(Node *n);
+  // Drop @n, which must be indexed under its current key
+  void Erase(Node *n);
+  // Drop every entry and the table itself
+  void Clear();
+
+ private:
+  struct Slot {
+    uint64_t hash;
+    Node *node;  // nullptr when free
+  };
+  // Tables start this big and double past 3/4 full
+  static constexpr unsigned kMinBits = 4;
+
+  static uint64_t Mix(const K &key) {
+    // Fibonacci hashing spreads identity hashes over the top bits
+    return static_cast<uint64_t>(Hash()(key)) * 0x9E3779B97F4A7C15ull;
+  }
+  std::size_t Home(uint64_t hash) const { return hash >> (64 - bits_); }
+  void Grow();
+
+  std::vector<Slot> slots_;
+  std::size_t size_ = 0;
+  unsigned bits_ = 0;
+};
+
+template <typename K, typename Node, typename Hash>
+Node* NodeIndex<K, Node, Hash>::Find(const K &key) const {
+  if (size_ == 0)
+    return nullptr;
+  uint64_t hash = Mix(key);
+  std::size_t mask = slots_.size() - 1;
+  for (std::size_t i = Home(hash);; i = (i + 1) & mask) {
+    const Slot &s = slots_[i];
+    if (!s.node)
+      return nullptr;
+    if (s.hash == hash && s.node->key == key)
+      return s.node;
+  }
+}
+
+template <typename K, typename Node, typename Hash>
+void NodeIndex<K, Node, Hash>::Insert(Node *n) {
+  if ((size_ + 1) * 4 > slots_.size() * 3)
+    Grow();
+  uint64_t hash = Mix(n->key);
+  std::size_t mask = slots_.size() - 1;
+  std::size_t i = Home(hash);
+  while (slots_[i].node)
+    i = (i + 1) & mask;
+  slots_[i] = Slot{hash, n};
+  size_++;
+}
+
+template <typename K, typename Node, typename Hash>
+void NodeIndex<K, Node, Hash>::Erase(Node *n) {
+  std::size_t mask = slots_.size() - 1;
+  std::size_t hole = Home(Mix(n->key));
+  while (slots_[hole].node != n)
+    hole = (hole + 1) & mask;
+  // Pull back every later entry of the run whose home is not inside the
+  // stretch between the hole and its current slot
+  for (std::size_t j = (hole + 1) & mask; slots_[j].node; j = (j + 1) & mask) {
+    std::size_t home = Home(slots_[j].hash);
+    bool stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+    if (!stays) {
+      slots_[hole] = slots_[j];
+      hole = j;
+    }
+  }
+  slots_[hole].node = nullptr;
+  size_--;
+}
+
+template <typename K, typename Node, typename Hash>
+void NodeIndex<K, Node, Hash>::Clear() {
+  std::vector<Slot>().swap(slots_);
+  size_ = 0;
+  bits_ = 0;
+}
+
+template <typename K, typename Node, typename Hash>
+void NodeIndex<K, Node, Hash>::Grow() {
+  std::vector<Slot> old(std::size_t(1) << (bits_ ? bits_ + 1 : kMinBits), Slot{0, nullptr});
+  old.swap(slots_);
+  bits_ = bits_ ? bits_ + 1 : kMinBits;
+  std::size_t mask = slots_.size() - 1;
+  for (const Slot &s : old) {
+    if (!s.node)
+      continue;
+    std::size_t i = Home(s.hash);
+    while (slots_[i].node)
+      i = (i + 1) & mask;
+    slots_[i] = s;
+  }
+}
+
+
+// Hot-path counters, compiled in only with -DMULTI_MAP_ENABLE_STATS
+// MULTI_MAP_STATS(...) expands to its argument when stats are enabled and
+// to nothing otherwise, so disabled builds pay nothing at all.
+#ifdef MULTI_MAP_ENABLE_STATS
+#define MULTI_MAP_STATS(...) __VA_ARGS__
+#else
+#define MULTI_MAP_STATS(...)
+#endif
+
+// Snapshot returned by Multi_Map::Stats(); all zero when stats are off
+struct MultiMapStats {
+  uint64_t rotations_left = 0;
+  uint64_t rotations_right = 0;
+  uint64_t color_flips = 0;
+  uint64_t fixups = 0;            // FixUp calls on insert and delete paths
+  uint64_t node_allocations = 0;  // nodes taken from the pool
+  uint64_t lookups = 0;           // Get/Contains/Erase descents
+  uint64_t lookup_depth = 0;      // nodes visited over all lookups
+  unsigned int max_lookup_depth = 0;
+  uint64_t duplicate_appends = 0;    // values added to an existing key
+  unsigned int max_duplicates = 0;   // longest value list seen
+  unsigned int size = 0;             // values stored when taken
+
+  // Return the mean number of nodes visited per lookup
+  double AvgLookupDepth() const {
+    return lookups ? static_cast<double>(lookup_depth) / lookups : 0.0;
+  }
+};
+
+// Backend policy for the default red-black tree layout
+// Other backends specialize Multi_Map on their own policy type and live in
+// their own headers.
+struct RBTreeBackend {};
+// The red-black tree plus a NodeIndex on the keys: Get, Contains, Erase
+// and UpdateKey find their node by hash, ordered operations use the tree
+struct HashIndexBackend {};
 
 // Change Map to Multimap
 // Simple Multi-Map implementation using a red-black tree
 // multimap allows multiple values for the same key
-template <typename K, typename V>
+template <typename K, typename V, typename Backend = RBTreeBackend>
 class Multi_Map {
  public:
   // node stores a key-value pair with references to the left and right children
+    // Values stored inline per key before the list spills to the heap
+    static constexpr unsigned kInlineValues =
+        sizeof(V) <= 4 ? 4 : (sizeof(V) <= 8 ? 2 : 1);
+
+    // Fields are ordered so the count fills the gap after a small key, and
+    // the color rides in the low bit of the parent pointer, which node
+    // alignment leaves zero; child links stay plain for the descents
     struct Node {
         K key;
-        std::vector<V> values; // change V to be store a vector of values instead of single values
-        bool color;
-        std::unique_ptr<Node> left;
-        std::unique_ptr<Node> right;
-
-        // Constructor 
-        Node(const K &key, const V &value, bool color) : key(key), value(value), color(color) {
-            value.push_back(value);
+        unsigned int count = 1;  // values in this subtree, duplicates included
+        ValueList<V, kInlineValues> values;  // values under this key, oldest first
+        Node *left = nullptr;
+        Node *right = nullptr;
+
+        // Constructor, builds the key and its first value in place
+        template <typename KK, typename... Args>
+        Node(bool color, KK &&key, Args&&... args)
+            : key(std::forward<KK>(key)), parent_color(color) {
+            values.emplace_back(std::forward<Args>(args)...);
         }
 
+        // Parent link, which lets iterators step without a stack
+        Node* Parent() const {
+            return reinterpret_cast<Node*>(parent_color & ~uintptr_t(1));
+        }
+        void SetParent(Node *p) {
+            parent_color = reinterpret_cast<uintptr_t>(p) | (parent_color & 1);
+        }
+        bool Color() const { return parent_color & 1; }
+        void SetColor(bool c) { parent_color = (parent_color & ~uintptr_t(1)) | c; }
+
+       private:
+        uintptr_t parent_color;  // parent pointer | color
     };
 
     // Constructor
-    Multi_Map() : root(nullptr), size_(0) {}
+    Multi_Map() : root(nullptr), leftmost(nullptr), cur_size(0) {}
+    // Build from (key, value) pairs in [first, last) sorted by key
+    template <typename It>
+    Multi_Map(It first, It last) : Multi_Map() {
+        BuildFromSorted(first, last);
+    }
 
     // Destructor
     ~Multi_Map() {
         Clear();
     }
 
+    // Nodes are owned by the pool, so the tree cannot be copied
+    Multi_Map(const Multi_Map &) = delete;
+    Multi_Map &operator=(const Multi_Map &) = delete;
+
+    // Bidirectional iterator over every (key, value) pair in key order,
+    // duplicates in insertion order; stepping follows parent links, so
+    // ++ and -- are amortized O(1) and never allocate
+    class iterator {
+     public:
+      using iterator_category = std::bidirectional_iterator_tag;
+      using value_type = std::pair<const K, V>;
+      using difference_type = std::ptrdiff_t;
+      using reference = std::pair<const K&, V&>;
+      // operator-> hands out a proxy holding the reference pair
+      struct pointer {
+        reference ref;
+        reference *operator->() { return &ref; }
+      };
+
+      iterator() = default;
+
+      reference operator*() const { return {node_->key, node_->values[index_]}; }
+      pointer operator->() const { return pointer{**this}; }
+
+      iterator &operator++() {
+        if (++index_ < node_->values.size())
+          return *this;
+        index_ = 0;
+        node_ = Multi_Map::NextLive(node_);
+        return *this;
+      }
+      iterator operator++(int) {
+        iterator old = *this;
+        ++*this;
+        return old;
+      }
+      iterator &operator--() {
+        if (node_ && index_ > 0) {
+          index_--;
+          return *this;
+        }
+        // Stepping back from end() lands on the max node
+        node_ = node_ ? Multi_Map::PrevLive(node_) : map_->MaxNode();
+        index_ = node_->values.size() - 1;
+        return *this;
+      }
+      iterator operator--(int) {
+        iterator old = *this;
+        --*this;
+        return old;
+      }
+
+      bool operator==(const iterator &o) const {
+        return node_ == o.node_ && index_ == o.index_;
+      }
+      bool operator!=(const iterator &o) const { return !(*this == o); }
+
+     private:
+      friend class Multi_Map;
+      iterator(Multi_Map *map, Node *node, unsigned index)
+          : map_(map), node_(node), index_(index) {}
+
+      Multi_Map *map_ = nullptr;
+      Node *node_ = nullptr;  // nullptr is end()
+      unsigned index_ = 0;    // position in node_->values
+    };
+
 
   // Return size of tree
   unsigned int Size();
@@ -47,277 +636,1629 @@ class Multi_Map {
   const V& Get(const K& key);
   // Return whether @key is found in tree
   bool Contains(const K& key);
+  // Point @out[i] at the first value of @keys[i], nullptr when missing,
+  // running a group of descents side by side so their cache misses overlap
+  void GetMany(const K *keys, std::size_t count, const V **out);
   // Return max key in tree
   const K& Max();
   // Return min key in tree
   const K& Min();
+  // Remove and return the first value of the min key
+  V PopMin();
   // Insert @key in tree
   void Insert(const K &key, const V &value);
-  // Remove @key from tree
-  void Remove(const K &key);
+  // Insert @key in tree, moving the key and value in
+  void Insert(K &&key, V &&value);
+  // Construct a value for @key in place from @args and return it
+  template <typename KK, typename... Args>
+  V& Emplace(KK &&key, Args&&... args);
+  // Remove the first value of @key, return whether anything was removed
+  bool Remove(const K &key);
+  // Remove the first occurrence of @value under @key
+  bool Erase(const K &key, const V &value);
+  // Move the first occurrence of @value under @old_key to @new_key,
+  // re-keying the node in place when it still fits between its neighbours
+  bool UpdateKey(const K &old_key, const V &value, const K &new_key);
+  // Remove every key and release all node memory
+  void Clear();
+  // Let Remove and PopMin leave a key's emptied node in place as a
+  // tombstone, compacting once tombstones pass @fraction of all entries;
+  // 0 goes back to deleting eagerly
+  void SetLazyRemove(double fraction);
+  // Drop every tombstone and rebuild the tree in O(n)
+  void Compact();
+  // Replace the contents with the sorted pairs in [first, last) in O(n)
+  template <typename It>
+  void BuildFromSorted(It first, It last);
+  // Insert the (key, value) pairs in [first, last); sorts the range in place
+  template <typename It>
+  void InsertBatch(It first, It last);
   // Print tree in-order
   void Print();
+  // Call @f(key, value) for every pair in key order, without recursion
+  template <typename F>
+  void ForEach(F f);
+  // Write every pair to @sink in @format, through one large buffer
+  void Dump(DumpSink &sink, DumpFormat format = DumpFormat::kText);
+  // Write every key with its values, in order, to @out in binary form
+  void Serialize(std::ostream &out);
+  // Replace the contents with a snapshot written by Serialize, in O(n)
+  void Deserialize(std::istream &in);
+
+  // Return an iterator to the first (key, value) pair
+  iterator begin();
+  // Return the past-the-end iterator
+  iterator end();
+  // Return an iterator to the first pair whose key is not less than @key
+  iterator lower_bound(const K &key);
+  // Return an iterator to the first pair whose key is greater than @key
+  iterator upper_bound(const K &key);
+  // Return the range of pairs whose key equals @key
+  std::pair<iterator, iterator> equal_range(const K &key);
+  // Return the number of values whose key is less than @key
+  unsigned int Rank(const K &key);
+  // Return an iterator to the pair at in-order position @i, end() if past
+  iterator Select(unsigned int i);
+  // Return the number of values whose key lies in [@lo, @hi]
+  unsigned int CountRange(const K &lo, const K &hi);
+  // Append all of @other, whose keys must all exceed ours, in O(log n)
+  // and leave it empty
+  void Join(Multi_Map &other);
+  // Move the pairs whose key is not below @key into @right, replacing its
+  // contents; the split is O(log n), handing the nodes over is linear
+  void Split(const K &key, Multi_Map &right);
+  // Move every pair of @other in, values of a shared key after ours, and
+  // leave it empty
+  void Union(Multi_Map &other, ForkJoinPool &pool = ForkJoinPool::Default());
+  // Keep only the keys @other also holds; @other is left unchanged
+  void Intersect(Multi_Map &other, ForkJoinPool &pool = ForkJoinPool::Default());
+  // Drop every key @other holds; @other is left unchanged
+  void Difference(Multi_Map &other, ForkJoinPool &pool = ForkJoinPool::Default());
+  // Remove every value whose key lies in [@lo, @hi], return how many
+  unsigned int EraseRange(const K &lo, const K &hi);
+  // Return the hot-path counters gathered so far
+  MultiMapStats Stats();
+  // Zero the hot-path counters
+  void ResetStats();
 
  private:
   enum Color { RED, BLACK };
-  struct Node{
-    K key;
-    V value;
-    bool color;
-    std::unique_ptr<Node> left;
-    std::unique_ptr<Node> right;
-  };
-  std::unique_ptr<Node> root;
+  // Longest root-to-leaf path: twice the black height, which is bounded by
+  // the bits of the size counter, plus slack for the transient extra level
+  // MoveRedLeft/MoveRedRight add during a delete
+  static constexpr int kMaxDepth = 2 * std::numeric_limits<unsigned int>::digits + 2;
+  // Descents GetMany keeps in flight at once
+  static constexpr std::size_t kLookupGroup = 16;
+  // Snapshot header: magic, format version, key count, value count
+  static constexpr uint32_t kSnapshotMagic = 0x50414d4d;  // "MMAP"
+  static constexpr uint32_t kSnapshotVersion = 1;
+  Node *root;
+  Node *leftmost;  // cached min node, nullptr when empty
   unsigned int cur_size = 0;
+  // Lazy removal: emptied nodes kept in the tree, and the share of
+  // entries they may reach before a compaction; 0 when removal is eager
+  unsigned int tombstones = 0;
+  double tombstone_limit = 0;
+  NodePool<Node> pool;
+  MULTI_MAP_STATS(MultiMapStats stats;)
+  // Lookup counters live apart from stats: lookups are reads, which
+  // ConcurrentMulti_Map runs on many threads at once, so they are relaxed
+  // atomics while the rest, bumped only by writers, stay plain
+  struct LookupCounters {
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> depth{0};
+    std::atomic<unsigned int> max_depth{0};
+
+    void Descended(unsigned int d) {
+      depth.fetch_add(d, std::memory_order_relaxed);
+      unsigned int max = max_depth.load(std::memory_order_relaxed);
+      while (d > max && !max_depth.compare_exchange_weak(max, d, std::memory_order_relaxed)) {}
+    }
+  };
+  MULTI_MAP_STATS(LookupCounters lookup_stats;)
+  static constexpr bool kHashIndex = std::is_same<Backend, HashIndexBackend>::value;
+  struct NoIndex {};
+  typename std::conditional<kHashIndex, NodeIndex<K, Node>, NoIndex>::type index;
+
+  // Take a node from the pool
+  template <typename... Args>
+  Node* NewNode(Args&&... args);
+  // Give @n back to the pool
+  void DeleteNode(Node *n);
+  // Note that @n just gained a value under an existing key
+  void CountDuplicate(Node *n);
+  // Keep the just emptied @n as a tombstone
+  void Bury(Node *n);
+  // Note that tombstone @n just got a value back
+  void Revive(Node *n);
 
   // Iterative helper methods
   Node* Get(Node *n, const K &key);
+  Node* Min(Node *n);
+  Node* MaxNode();
+  static Node* Next(Node *n);
+  static Node* Prev(Node *n);
+  static Node* NextLive(Node *n);
+  static Node* PrevLive(Node *n);
+  template <typename KK, typename... Args>
+  Node* Insert(Node *&n, KK &&key, Args&&... args);
+  bool Remove(Node *&n, const K &key);
+  Node* UnlinkMin(Node **link, Node **path[], int &depth);
+  Node* TreeToVine(Node *n);
+  void SetParents(Node *n);
+  static unsigned int Count(Node *n);
+  void Update(Node *n);
+  void AddCount(Node *n, int delta);
+  unsigned int Rank(const K &key, bool inclusive);
+  template <typename NextNode>
+  Node* Build(std::size_t count, NextNode &next);
 
   // Recursive helper methods
-  Node* Min(Node *n);
-  void Insert(std::unique_ptr<Node> &n, const K &key, const V &value);
-  void Remove(std::unique_ptr<Node> &n, const K &key);
-  void Print(Node *n);
+  template <typename NextNode>
+  Node* BuildSubtree(std::size_t count, std::size_t max_count, NextNode &next);
 
-  // Helper methods for the self-balancing
+  // Helper methods for the self-balancing, thin wrappers over LLRB, which
+  // reaches the nodes through the accessors and hooks below
+  friend struct LLRB<Multi_Map>;
+  using Link = Node*;
+  static constexpr Node *kNil = nullptr;
+  static Node*& LeftOf(Node *n) { return n->left; }
+  static Node*& RightOf(Node *n) { return n->right; }
+  static bool ColorOf(Node *n) { return n->Color(); }
+  static void SetColorOf(Node *n, bool c) { n->SetColor(c); }
+  void Rotated(Node *prt, Node *chd, bool left);
+  void Flipped(Node *) { MULTI_MAP_STATS(stats.color_flips++;) }
+  void FixingUp(Node *) { MULTI_MAP_STATS(stats.fixups++;) }
   bool IsRed(Node *n);
   void FlipColors(Node *n);
-  void RotateRight(std::unique_ptr<Node> &prt);
-  void RotateLeft(std::unique_ptr<Node> &prt);
-  void FixUp(std::unique_ptr<Node> &n);
-  void MoveRedRight(std::unique_ptr<Node> &n);
-  void MoveRedLeft(std::unique_ptr<Node> &n);
-  void DeleteMin(std::unique_ptr<Node> &n);
+  void RotateRight(Node *&prt);
+  void RotateLeft(Node *&prt);
+  void FixUp(Node *&n);
+  void MoveRedRight(Node *&n);
+  void MoveRedLeft(Node *&n);
+  void DeleteMin(Node *&n);
+
+  // Join-based bulk operations on detached subtrees, whose roots are
+  // black with no parent; each returns such a root
+  // Subtrees holding fewer values than this are not worth a fork
+  static constexpr unsigned int kForkCutoff = 1 << 14;
+  // State shared by the tasks of one bulk operation
+  struct BulkContext {
+    ForkJoinPool *pool;                  // nullptr to stay on this thread
+    std::atomic<Node*> dead{nullptr};    // nodes to free at the end, linked by left
+  };
+  static Node* Detach(Node *n);
+  int BlackHeight(Node *n);
+  Node* Join(Node *l, Node *m, Node *r);
+  Node* Join(Node *l, Node *r);
+  Node* PopMinNode(Node *&top);
+  void Split(Node *t, const K &key, Node *&l, Node *&m, Node *&r);
+  Node* Union(Node *a, Node *b, BulkContext &ctx);
+  Node* Intersect(Node *a, Node *b, BulkContext &ctx);
+  Node* Difference(Node *a, Node *b, BulkContext &ctx);
+  template <typename A, typename C>
+  void Fork(BulkContext &ctx, unsigned int work, A a, C c);
+  static void Discard(BulkContext &ctx, Node *n);
+  void DiscardTree(BulkContext &ctx, Node *n);
+  Node* Adopt(Multi_Map &other);
+  void FinishBulk(BulkContext &ctx);
 };
 
-template <typename K, typename V>
-unsigned int Multi_Map<K, V>::Size() {
+template <typename K, typename V, typename B>
+unsigned int Multi_Map<K, V, B>::Size() {
   return cur_size;
 }
-template <typename K, typename V>
+template <typename K, typename V, typename B>
 //Method Get() should return the first value in the list of values associated to the given key.
-typename Multi_Map<K, V>::Node* Multi_Map<K, V>::Get(Node *n, const K &key) {
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Get(Node *n, const K &key) {
+  // Every caller searches from the root, which the index stands in for
+  if constexpr (kHashIndex) {
+    n = index.Find(key);
+    return n && !n->values.empty() ? n : nullptr;
+  }
+  MULTI_MAP_STATS(unsigned int depth = 0;)
+  MULTI_MAP_STATS(lookup_stats.lookups.fetch_add(1, std::memory_order_relaxed);)
   while (n) {
+    MULTI_MAP_STATS(depth++;)
     if (key == n->key)
-      return n;
+      break;
 
     if (key < n->key)
-      n = n->left.get();
+      n = n->left;
     else
-      n = n->right.get();
+      n = n->right;
   }
-  return nullptr;
+  MULTI_MAP_STATS(lookup_stats.Descended(depth);)
+  // A tombstone only holds the key's place
+  return n && !n->values.empty() ? n : nullptr;
 }
 
-template <typename K, typename V>
-const V& Multi_Map<K, V>::Get(const K &key) {
-  Node *n = Get(root.get(), key);
+template <typename K, typename V, typename B>
+const V& Multi_Map<K, V, B>::Get(const K &key) {
+  Node *n = Get(root, key);
   if (!n)
     throw std::runtime_error("Error: cannot find key");
-  return n->values[0]; // return the first value in the list
+  return n->values.front(); // return the first value in the list
 }
 
-template <typename K, typename V>
-bool Multi_Map<K, V>::Contains(const K &key) {
-  return Get(root.get(), key) != nullptr;
+template <typename K, typename V, typename B>
+bool Multi_Map<K, V, B>::Contains(const K &key) {
+  return Get(root, key) != nullptr;
 }
 
-template <typename K, typename V>
-const K& Multi_Map<K, V>::Max(void) {
-  Node *n = root.get();
-  while (n->right) n = n->right.get();
-  return n->key;
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::GetMany(const K *keys, std::size_t count, const V **out) {
+  MULTI_MAP_STATS(lookup_stats.lookups.fetch_add(count, std::memory_order_relaxed);)
+  for (std::size_t base = 0; base < count; base += kLookupGroup) {
+    std::size_t lanes = std::min(kLookupGroup, count - base);
+    if constexpr (kHashIndex) {
+      for (std::size_t i = 0; i < lanes; i++)
+        index.Prefetch(keys[base + i]);
+      for (std::size_t i = 0; i < lanes; i++) {
+        Node *n = index.Find(keys[base + i]);
+        out[base + i] = n && !n->values.empty() ? &n->values.front() : nullptr;
+      }
+      continue;
+    }
+    // Step every unfinished descent one level per round, prefetching the
+    // child it moves to so the next round finds it in cache
+    Node *cur[kLookupGroup];
+    MULTI_MAP_STATS(unsigned int depth[kLookupGroup] = {};)
+    for (std::size_t i = 0; i < lanes; i++) {
+      cur[i] = root;
+      out[base + i] = nullptr;
+    }
+    for (std::size_t live = root ? lanes : 0; live > 0;) {
+      for (std::size_t i = 0; i < lanes; i++) {
+        Node *n = cur[i];
+        if (!n)
+          continue;
+        MULTI_MAP_STATS(depth[i]++;)
+        const K &key = keys[base + i];
+        if (key < n->key) {
+          n = n->left;
+        } else if (n->key < key) {
+          n = n->right;
+        } else {
+          if (!n->values.empty())
+            out[base + i] = &n->values.front();
+          n = nullptr;
+        }
+        if (n) {
+          MULTI_MAP_PREFETCH(n);
+        } else {
+          live--;
+          MULTI_MAP_STATS(lookup_stats.Descended(depth[i]);)
+        }
+        cur[i] = n;
+      }
+    }
+  }
 }
 
-template <typename K, typename V>
-const K& Multi_Map<K, V>::Min(void) {
-  return Min(root.get())->key;
+template <typename K, typename V, typename B>
+const K& Multi_Map<K, V, B>::Max(void) {
+  return MaxNode()->key;
 }
 
-template <typename K, typename V>
-typename Multi_Map<K, V>::Node* Multi_Map<K, V>::Min(Node *n) {
-  if (n->left)
-    return Min(n->left.get());
-  else
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::MaxNode() {
+  Node *n = root;
+  while (n->right) n = n->right;
+  return n->values.empty() ? PrevLive(n) : n;
+}
+
+// In-order successor of @n, nullptr past the max
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Next(Node *n) {
+  if (n->right) {
+    n = n->right;
+    while (n->left) n = n->left;
+    return n;
+  }
+  while (n->Parent() && n == n->Parent()->right) n = n->Parent();
+  return n->Parent();
+}
+
+// In-order predecessor of @n, nullptr before the min
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Prev(Node *n) {
+  if (n->left) {
+    n = n->left;
+    while (n->right) n = n->right;
     return n;
+  }
+  while (n->Parent() && n == n->Parent()->left) n = n->Parent();
+  return n->Parent();
 }
 
-template <typename K, typename V>
-bool Multi_Map<K, V>::IsRed(Node *n) {
-  if (!n) return false;
-  return (n->color == RED);
+// Nearest node after @n that still holds values
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::NextLive(Node *n) {
+  do {
+    n = Next(n);
+  } while (n && n->values.empty());
+  return n;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::FlipColors(Node *n) {
-  n->color = !n->color;
-  n->left->color = !n->left->color;
-  n->right->color = !n->right->color;
+// Nearest node before @n that still holds values
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::PrevLive(Node *n) {
+  do {
+    n = Prev(n);
+  } while (n && n->values.empty());
+  return n;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::RotateRight(std::unique_ptr<Node> &prt) {
-  std::unique_ptr<Node> chd = std::move(prt->left);
-  prt->left = std::move(chd->right);
-  chd->color = prt->color;
-  prt->color = RED;
-  chd->right = std::move(prt);
-  prt = std::move(chd);
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::iterator Multi_Map<K, V, B>::begin() {
+  return iterator(this, leftmost, 0);
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::RotateLeft(std::unique_ptr<Node> &prt) {
-  std::unique_ptr<Node> chd = std::move(prt->right);
-  prt->right = std::move(chd->left);
-  chd->color = prt->color;
-  prt->color = RED;
-  chd->left = std::move(prt);
-  prt = std::move(chd);
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::iterator Multi_Map<K, V, B>::end() {
+  return iterator(this, nullptr, 0);
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::FixUp(std::unique_ptr<Node> &n) {
-  // Rotate left if there is a right-leaning red node
-  if (IsRed(n->right.get()) && !IsRed(n->left.get()))
-    RotateLeft(n);
-  // Rotate right if red-red pair of nodes on left
-  if (IsRed(n->left.get()) && IsRed(n->left->left.get()))
-    RotateRight(n);
-  // Recoloring if both children are red
-  if (IsRed(n->left.get()) && IsRed(n->right.get()))
-    FlipColors(n.get());
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::iterator Multi_Map<K, V, B>::lower_bound(const K &key) {
+  Node *best = nullptr;
+  for (Node *n = root; n;) {
+    if (n->key < key) {
+      n = n->right;
+    } else {
+      best = n;
+      n = n->left;
+    }
+  }
+  if (best && best->values.empty())
+    best = NextLive(best);
+  return iterator(this, best, 0);
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::MoveRedRight(std::unique_ptr<Node> &n) {
-  FlipColors(n.get());
-  if (IsRed(n->left->left.get())) {
-    RotateRight(n);
-    FlipColors(n.get());
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::iterator Multi_Map<K, V, B>::upper_bound(const K &key) {
+  Node *best = nullptr;
+  for (Node *n = root; n;) {
+    if (key < n->key) {
+      best = n;
+      n = n->left;
+    } else {
+      n = n->right;
+    }
   }
+  if (best && best->values.empty())
+    best = NextLive(best);
+  return iterator(this, best, 0);
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::MoveRedLeft(std::unique_ptr<Node> &n) {
-  FlipColors(n.get());
-  if (IsRed(n->right->left.get())) {
-    RotateRight(n->right);
-    RotateLeft(n);
-    FlipColors(n.get());
+template <typename K, typename V, typename B>
+std::pair<typename Multi_Map<K, V, B>::iterator,
+          typename Multi_Map<K, V, B>::iterator>
+Multi_Map<K, V, B>::equal_range(const K &key) {
+  iterator first = lower_bound(key);
+  // Duplicates share one node, so the range ends at its successor
+  if (first.node_ && first.node_->key == key)
+    return {first, iterator(this, NextLive(first.node_), 0)};
+  return {first, first};
+}
+
+template <typename K, typename V, typename B>
+const K& Multi_Map<K, V, B>::Min(void) {
+  return leftmost->key;
+}
+
+template <typename K, typename V, typename B>
+V Multi_Map<K, V, B>::PopMin() {
+  if (!leftmost)
+    throw std::runtime_error("Error: tree is empty");
+  V value = std::move(leftmost->values.front());
+  if (leftmost->values.size() > 1 || tombstone_limit > 0) {
+    Node *n = leftmost;
+    n->values.pop_front();
+    AddCount(n, -1);
+    cur_size--;
+    if (n->values.empty())
+      Bury(n);
+    return value;
   }
+  // The new min is the old one's in-order successor; with no left child,
+  // and so no right one, that is its parent. Rotations keep the in-order
+  // sequence, so the node is still the min once DeleteMin is done.
+  Node *next = Next(leftmost);
+  DeleteMin(root);
+  if (root)
+    root->SetColor(BLACK);
+  leftmost = next;
+  cur_size--;
+  return value;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::DeleteMin(std::unique_ptr<Node> &n) {
-  // No left child, min is 'n'
-  if (!n->left) {
-    // Remove n
-    n = nullptr;
-    return;
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Min(Node *n) {
+  while (n->left) n = n->left;
+  return n;
+}
+
+template <typename K, typename V, typename B>
+bool Multi_Map<K, V, B>::IsRed(Node *n) {
+  return LLRB<Multi_Map>::IsRed(*this, n);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::FlipColors(Node *n) {
+  LLRB<Multi_Map>::FlipColors(*this, n);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::RotateRight(Node *&prt) {
+  LLRB<Multi_Map>::RotateRight(*this, prt);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::RotateLeft(Node *&prt) {
+  LLRB<Multi_Map>::RotateLeft(*this, prt);
+}
+
+// Repair the parent links and counts around a rotation
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Rotated(Node *prt, Node *chd, bool left) {
+  MULTI_MAP_STATS(if (left) stats.rotations_left++; else stats.rotations_right++;)
+  Node *inner = left ? prt->right : prt->left;
+  if (inner)
+    inner->SetParent(prt);
+  chd->SetParent(prt->Parent());
+  prt->SetParent(chd);
+  chd->count = prt->count;
+  Update(prt);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::FixUp(Node *&n) {
+  LLRB<Multi_Map>::FixUp(*this, n);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::MoveRedRight(Node *&n) {
+  LLRB<Multi_Map>::MoveRedRight(*this, n);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::MoveRedLeft(Node *&n) {
+  LLRB<Multi_Map>::MoveRedLeft(*this, n);
+}
+
+// Walk down the left spine from @link pushing each visited link on @path,
+// unhook the min node and return it; the caller fixes up the path
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::UnlinkMin(Node **link,
+                                                                 Node **path[],
+                                                                 int &depth) {
+  while ((*link)->left) {
+    Node *n = *link;
+    if (!IsRed(n->left) && !IsRed(n->left->left))
+      MoveRedLeft(*link);
+    path[depth++] = link;
+    link = &(*link)->left;
   }
-if (!IsRed(n->left.get()) && !IsRed(n->left->left.get()))
-    MoveRedLeft(n);
+  // No left child, min is '*link'
+  Node *n_min = *link;
+  *link = nullptr;
+  return n_min;
+}
 
-  DeleteMin(n->left);
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::DeleteMin(Node *&n) {
+  Node **path[kMaxDepth];
+  int depth = 0;
+  DeleteNode(UnlinkMin(&n, path, depth));
+  while (depth > 0) {
+    Node **l = path[--depth];
+    FixUp(*l);
+    Update(*l);
+  }
+}
 
-  FixUp(n);
+template <typename K, typename V, typename B>
+bool Multi_Map<K, V, B>::Remove(const K &key) {
+  if (tombstone_limit > 0) {
+    // One lookup and a count walk; the shape is left alone
+    Node *n = Get(root, key);
+    if (!n)
+      return false;
+    n->values.pop_front();
+    AddCount(n, -1);
+    cur_size--;
+    if (n->values.empty())
+      Bury(n);
+    return true;
+  }
+  bool was_min = leftmost && key == leftmost->key;
+  if (was_min && leftmost->values.size() > 1) {
+    leftmost->values.pop_front();
+    AddCount(leftmost, -1);
+    cur_size--;
+    return true;
+  }
+  bool removed = Remove(root, key);
+  // The descent may have left a red root behind even on a miss
+  if (root)
+    root->SetColor(BLACK);
+  if (!removed)
+    return false;
+  cur_size--;
+  if (was_min)
+    leftmost = root ? Min(root) : nullptr;
+  return true;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::Remove(const K &key) {
-  if (!Contains(key))
-    return;
-  Remove(root, key);
+template <typename K, typename V, typename B>
+bool Multi_Map<K, V, B>::Erase(const K &key, const V &value) {
+  Node *n = Get(root, key);
+  if (!n)
+    return false;
+  auto it = std::find(n->values.begin(), n->values.end(), value);
+  if (it == n->values.end())
+    return false;
+  // Only the last value of a key takes the node out of the tree
+  if (n->values.size() == 1)
+    return Remove(key);
+  n->values.erase(it);
+  AddCount(n, -1);
   cur_size--;
-  if (root)
-    root->color = BLACK;
+  return true;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::Remove(std::unique_ptr<Node> &n, const K &key) {
-  // Key not found
-  if (!n) return;
-  if (subtree_root -> values.size() > 1) {
-    subtree_root -> values.erase(subtree_root -> values.begin()); // remove the first value in the list
-    return;
+template <typename K, typename V, typename B>
+bool Multi_Map<K, V, B>::UpdateKey(const K &old_key, const V &value, const K &new_key) {
+  Node *n = Get(root, old_key);
+  if (!n)
+    return false;
+  auto it = std::find(n->values.begin(), n->values.end(), value);
+  if (it == n->values.end())
+    return false;
+  if (new_key == old_key)
+    return true;
+  if (n->values.size() == 1) {
+    // A lone value can take its node along if the in-order slot holds,
+    // which leaves the shape, colors, counts and leftmost as they are
+    Node *prev = Prev(n);
+    Node *next = Next(n);
+    if ((!prev || prev->key < new_key) && (!next || new_key < next->key)) {
+      if constexpr (kHashIndex)
+        index.Erase(n);
+      n->key = new_key;
+      if constexpr (kHashIndex)
+        index.Insert(n);
+      return true;
+    }
   }
-  if (key < n->key) {
-    if (!IsRed(n->left.get()) && !IsRed(n->left->left.get()))
-      MoveRedLeft(n);
-    Remove(n->left, key);
+  V moved = std::move(*it);
+  if (n->values.size() == 1) {
+    Remove(old_key);
   } else {
-    if (IsRed(n->left.get()))
-      RotateRight(n);
+    n->values.erase(it);
+    AddCount(n, -1);
+    cur_size--;
+  }
+  Emplace(new_key, std::move(moved));
+  return true;
+}
+
+// Top-down delete: push a red link ahead of the search so the node to
+// unlink is never a 2-node, recording each link for the way back up.
+// Existence is decided on the same descent; a miss or a duplicate pop
+// leaves only the local transformations, which the fix-up pass undoes.
+template <typename K, typename V, typename B>
+bool Multi_Map<K, V, B>::Remove(Node *&top, const K &key) {
+  Node **path[kMaxDepth];
+  int depth = 0;
+  bool removed = false;
+  Node **link = &top;
+  while (Node *n = *link) {
+    path[depth++] = link;
+    if (key == n->key && n->values.size() > 1) {
+      n->values.pop_front(); // remove the first value in the list
+      removed = true;
+      break;
+    }
+    if (key < n->key) {
+      // Key not found
+      if (!n->left) break;
+      if (!IsRed(n->left) && !IsRed(n->left->left))
+        MoveRedLeft(*link);
+      link = &(*link)->left;
+      continue;
+    }
+
+    if (IsRed(n->left)) {
+      RotateRight(*link);
+      n = *link;
+    }
 
     if (key == n->key && !n->right) {
       // Remove n
-      n = nullptr;
-      return;
+      DeleteNode(n);
+      *link = nullptr;
+      depth--;
+      removed = true;
+      break;
     }
+    // Key not found
+    if (!n->right) break;
 
-    if (!IsRed(n->right.get()) && !IsRed(n->right->left.get()))
-      MoveRedRight(n);
+    if (!IsRed(n->right) && !IsRed(n->right->left)) {
+      MoveRedRight(*link);
+      n = *link;
+    }
 
     if (key == n->key) {
-      // Find min node in the right subtree
-      Node *n_min = Min(n->right.get());
-      // Copy content from min node
-      n->key = n_min->key;
-      n->value = n_min->value;
-      // Delete min node recursively
-      DeleteMin(n->right);
-    } else {
-      Remove(n->right, key);
+      // Relink the min node of the right subtree in n's place; the entry
+      // UnlinkMin pushed for n's right link must follow it
+      int below = depth;
+      Node *n_min = UnlinkMin(&n->right, path, depth);
+      n_min->left = n->left;
+      n_min->right = n->right;
+      n_min->SetColor(n->Color());
+      n_min->SetParent(n->Parent());
+      if (n_min->left)
+        n_min->left->SetParent(n_min);
+      if (n_min->right)
+        n_min->right->SetParent(n_min);
+      *link = n_min;
+      if (depth > below)
+        path[below] = &n_min->right;
+      DeleteNode(n);
+      removed = true;
+      break;
     }
+    link = &n->right;
   }
 
-  FixUp(n);
+  // Every ancestor of the change is on the path, so recounting on the way
+  // up repairs the counts whether or not anything was removed
+  while (depth > 0) {
+    Node **l = path[--depth];
+    FixUp(*l);
+    Update(*l);
+  }
+  return removed;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::Insert(const K &key, const V &value) {
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Insert(const K &key, const V &value) {
   Insert(root, key, value);
   cur_size++;
-  root->color = BLACK;
+  root->SetColor(BLACK);
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::Insert(std::unique_ptr<Node> &n,
-                       const K &key, const V &value) {
-  if (!n)
-    n = std::unique_ptr<Node>(new Node{key, value, RED});
-  else if (key < n->key)
-    Insert(n->left, key, value);
-  else if (key > n->key)
-    Insert(n->right, key, value);
-  else if (key == current->key)
-    current->value.push_back(value); // add the value to the end of list 
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Insert(K &&key, V &&value) {
+  Insert(root, std::move(key), std::move(value));
+  cur_size++;
+  root->SetColor(BLACK);
+}
+
+template <typename K, typename V, typename B>
+template <typename KK, typename... Args>
+V& Multi_Map<K, V, B>::Emplace(KK &&key, Args&&... args) {
+  Node *n = Insert(root, std::forward<KK>(key), std::forward<Args>(args)...);
+  cur_size++;
+  root->SetColor(BLACK);
+  return n->values.back();
+}
+
+// Add a value built from @args under @key and return the node that holds
+// it; the key is only copied or moved in when a new node is needed
+template <typename K, typename V, typename B>
+template <typename KK, typename... Args>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Insert(Node *&top,
+                                                              KK &&key,
+                                                              Args&&... args) {
+  Node **path[kMaxDepth];
+  int depth = 0;
+  Node **link = &top;
+  Node *parent = nullptr;
+  while (Node *n = *link) {
+    parent = n;
+    // The new value lands somewhere below every node on the way down
+    n->count++;
+    if (key < n->key) {
+      path[depth++] = link;
+      link = &n->left;
+    } else if (key > n->key) {
+      path[depth++] = link;
+      link = &n->right;
+    } else {
+      try {
+        n->values.emplace_back(std::forward<Args>(args)...); // add the value to the end of list
+      } catch (...) {
+        // Take back the counts added on the way down
+        AddCount(n, -1);
+        throw;
+      }
+      if (n->values.size() == 1)
+        Revive(n);
+      else
+        CountDuplicate(n);
+      return n;
+    }
+  }
+
+  // A named color: GCC 12 at -O2 can hand the stack slot of a RED
+  // temporary bound to NewNode's forwarding reference to path
+  bool color = RED;
+  Node *n;
+  try {
+    n = NewNode(color, std::forward<KK>(key), std::forward<Args>(args)...);
+  } catch (...) {
+    AddCount(parent, -1);
+    throw;
+  }
+  n->SetParent(parent);
+  *link = n;
+  if (!leftmost || n->key < leftmost->key)
+    leftmost = n;
+
+  // Rotations and flips only ever turn a black subtree root red, so once a
+  // level comes out black its parent sees no change and we can stop
+  while (depth > 0) {
+    Node **l = path[--depth];
+    FixUp(*l);
+    if (!IsRed(*l)) break;
+  }
+  return n;
+}
+
+template <typename K, typename V, typename B>
+template <typename It>
+void Multi_Map<K, V, B>::InsertBatch(It first, It last) {
+  std::size_t count = std::distance(first, last);
+  if (count == 0)
     return;
-  else
-    throw std::runtime_error("Key already inserted");
+  // Stable, so equal keys keep their batch order behind existing values
+  std::stable_sort(first, last, [](const auto &a, const auto &b) {
+    return a.first < b.first;
+  });
 
-  FixUp(n);
+  if (count * 4 < cur_size) {
+    // Small batch: sorted descents share the cache-hot upper path, and
+    // each run of equal keys costs a single descent
+    for (It it = first; it != last;) {
+      Node *n = Insert(root, it->first, it->second);
+      root->SetColor(BLACK);
+      int run = 0;
+      for (++it; it != last && it->first == n->key; ++it, ++run) {
+        n->values.push_back(it->second);
+        CountDuplicate(n);
+      }
+      AddCount(n, run);
+    }
+    cur_size += count;
+    return;
+  }
+
+  // Large batch: merge it into the in-order vine of existing nodes, then
+  // relink the vine into a balanced tree
+  Node *vine = TreeToVine(root);
+  Node **link = &vine;
+  std::size_t nodes = 0;
+  // Tombstones passed on the way are dropped, so none survive the rebuild
+  auto skip = [&]() {
+    Node *n = *link;
+    if (n->values.empty()) {
+      *link = n->right;
+      DeleteNode(n);
+    } else {
+      link = &n->right;
+      nodes++;
+    }
+  };
+  for (It it = first; it != last;) {
+    while (*link && (*link)->key < it->first)
+      skip();
+    Node *n = *link;
+    if (n && n->key == it->first) {
+      n->values.push_back(it->second);
+      CountDuplicate(n);
+    } else {
+      n = NewNode(BLACK, it->first, it->second);
+      n->right = *link;
+      *link = n;
+    }
+    for (++it; it != last && it->first == n->key; ++it) {
+      n->values.push_back(it->second);
+      CountDuplicate(n);
+    }
+  }
+  while (*link)
+    skip();
+  tombstones = 0;
+
+  auto next = [&]() {
+    Node *n = vine;
+    vine = vine->right;
+    n->SetColor(BLACK);
+    return n;
+  };
+  root = Build(nodes, next);
+  leftmost = Min(root);
+  cur_size += count;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::Print() {
-  Print(root.get());
-  std::cout << std::endl;
+// Flatten the subtree at @n into an in-order list linked through right
+// pointers, using right rotations only (no recursion, no stack)
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::TreeToVine(Node *n) {
+  Node *vine = n;
+  Node **tail = &vine;
+  while (Node *t = *tail) {
+    if (t->left) {
+      Node *l = t->left;
+      t->left = l->right;
+      l->right = t;
+      *tail = l;
+    } else {
+      tail = &t->right;
+    }
+  }
+  return vine;
 }
 
-template <typename K, typename V>
-void Multi_Map<K, V>::Print(Node *n) {
-  if (!n) return;
-  std::cout << subtree_root -> key << ": [";
-  // print all the values in the list 
-  for (size_t i = 0; i < subtree_root -> values.size(); i++) {
-    std::cout << subtree_root -> values[i];
-    if (i != subtree_root -> values.size() - 1) {
-      std::cout << ", ";
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Clear() {
+  // Destroy payloads along the flattened tree
+  if (!std::is_trivially_destructible<Node>::value) {
+    for (Node *n = TreeToVine(root); n;) {
+      Node *next = n->right;
+      n->~Node();
+      n = next;
     }
   }
-    std::cout << "] " << std::endl;
+  // The slots themselves go back chunk by chunk
+  pool.Release();
+  if constexpr (kHashIndex)
+    index.Clear();
+  root = nullptr;
+  leftmost = nullptr;
+  cur_size = 0;
+  tombstones = 0;
 }
 
-#endif  // MULTI_MAP_H_
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::SetLazyRemove(double fraction) {
+  if (!(fraction >= 0 && fraction <= 1))
+    throw std::runtime_error("Error: tombstone fraction must be in [0, 1]");
+  tombstone_limit = fraction;
+  if (fraction == 0 && tombstones > 0)
+    Compact();
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Compact() {
+  Node *vine = TreeToVine(root);
+  std::size_t nodes = 0;
+  for (Node **link = &vine; *link;) {
+    Node *n = *link;
+    if (n->values.empty()) {
+      *link = n->right;
+      DeleteNode(n);
+    } else {
+      link = &n->right;
+      nodes++;
+    }
+  }
+  auto next = [&]() {
+    Node *n = vine;
+    vine = vine->right;
+    n->SetColor(BLACK);
+    return n;
+  };
+  root = Build(nodes, next);
+  leftmost = root ? Min(root) : nullptr;
+  tombstones = 0;
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Bury(Node *n) {
+  tombstones++;
+  if (n == leftmost)
+    leftmost = NextLive(n);
+  if (tombstones > tombstone_limit * (tombstones + cur_size))
+    Compact();
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Revive(Node *n) {
+  tombstones--;
+  if (!leftmost || n->key < leftmost->key)
+    leftmost = n;
+}
+
+template <typename K, typename V, typename B>
+template <typename It>
+void Multi_Map<K, V, B>::BuildFromSorted(It first, It last) {
+  // Validate the order and count distinct keys before allocating anything
+  std::size_t keys = 0;
+  for (It it = first, prev = first; it != last; prev = it, ++it) {
+    if (it == first || !(it->first == prev->first)) {
+      if (it != first && it->first < prev->first)
+        throw std::runtime_error("Error: input is not sorted");
+      keys++;
+    }
+  }
+
+  Clear();
+  if (keys == 0)
+    return;
+
+  It it = first;
+  // Hand out one node per run of equal keys, in order
+  auto next = [&]() {
+    Node *n = NewNode(BLACK, it->first, it->second);
+    for (++it; it != last && it->first == n->key; ++it)
+      n->values.push_back(it->second);
+    MULTI_MAP_STATS(stats.max_duplicates = std::max<unsigned int>(stats.max_duplicates, n->values.size());)
+    cur_size += n->values.size();
+    return n;
+  };
+  root = Build(keys, next);
+  leftmost = Min(root);
+}
+
+// Layout: magic, version, key count and value count, then per key the
+// key, its value count and the values, keys ascending
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Serialize(std::ostream &out) {
+  uint64_t keys = 0;
+  for (Node *n = leftmost; n; n = NextLive(n))
+    keys++;
+  uint64_t values = cur_size;
+  MultiMapCodec<uint32_t>::Write(out, kSnapshotMagic);
+  MultiMapCodec<uint32_t>::Write(out, kSnapshotVersion);
+  MultiMapCodec<uint64_t>::Write(out, keys);
+  MultiMapCodec<uint64_t>::Write(out, values);
+  for (Node *n = leftmost; n; n = NextLive(n)) {
+    MultiMapCodec<K>::Write(out, n->key);
+    MultiMapCodec<uint32_t>::Write(out, n->values.size());
+    for (const V &v : n->values)
+      MultiMapCodec<V>::Write(out, v);
+  }
+  if (!out)
+    throw std::runtime_error("Error: cannot write snapshot");
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Deserialize(std::istream &in) {
+  uint32_t magic, version;
+  uint64_t keys, values;
+  if (!MultiMapCodec<uint32_t>::Read(in, magic) || magic != kSnapshotMagic ||
+      !MultiMapCodec<uint32_t>::Read(in, version) || version != kSnapshotVersion ||
+      !MultiMapCodec<uint64_t>::Read(in, keys) || !MultiMapCodec<uint64_t>::Read(in, values))
+    throw std::runtime_error("Error: not a snapshot");
+  Clear();
+
+  // Read into a vine first, so a bad snapshot leaves no half-built tree
+  Node *vine = nullptr;
+  Node **tail = &vine;
+  Node *prev = nullptr;
+  uint64_t seen = 0;
+  const char *error = nullptr;
+  try {
+    for (uint64_t i = 0; i < keys && !error; i++) {
+      K key;
+      uint32_t count;
+      V value;
+      if (!MultiMapCodec<K>::Read(in, key) || !MultiMapCodec<uint32_t>::Read(in, count) ||
+          count == 0 || !MultiMapCodec<V>::Read(in, value)) {
+        error = "Error: snapshot is truncated";
+        break;
+      }
+      if (prev && !(prev->key < key)) {
+        error = "Error: input is not sorted";
+        break;
+      }
+      Node *n = NewNode(BLACK, std::move(key), std::move(value));
+      *tail = n;
+      tail = &n->right;
+      prev = n;
+      for (uint32_t j = 1; j < count; j++) {
+        if (!MultiMapCodec<V>::Read(in, value)) {
+          error = "Error: snapshot is truncated";
+          break;
+        }
+        n->values.push_back(std::move(value));
+      }
+      MULTI_MAP_STATS(stats.max_duplicates = std::max<unsigned int>(stats.max_duplicates, n->values.size());)
+      seen += n->values.size();
+    }
+  } catch (...) {
+    // A throwing codec or allocation must not leak the vine either
+    root = vine;
+    Clear();
+    throw;
+  }
+  if (!error && seen != values)
+    error = "Error: snapshot is truncated";
+  if (error) {
+    root = vine;  // Clear flattens it, which a vine already is
+    Clear();
+    throw std::runtime_error(error);
+  }
+
+  auto next = [&]() {
+    Node *n = vine;
+    vine = vine->right;
+    return n;
+  };
+  root = Build(keys, next);
+  leftmost = root ? Min(root) : nullptr;
+  cur_size = values;
+}
+
+// Link @count nodes handed out in key order by @next into a balanced tree
+template <typename K, typename V, typename B>
+template <typename NextNode>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Build(std::size_t count,
+                                                             NextNode &next) {
+  if (count == 0)
+    return nullptr;
+  // Take black height floor(log2(count + 1)); a 2-3 tree that tall holds
+  // up to 3^h - 1 keys, which always covers @count
+  std::size_t max_count = 2;
+  for (std::size_t k = (count + 1) >> 2; k > 0; k >>= 1)
+    max_count = max_count * 3 + 2;
+  Node *top = BuildSubtree(count, max_count, next);
+  top->SetParent(nullptr);
+  return top;
+}
+
+// Point the children of freshly linked @n back at it
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::SetParents(Node *n) {
+  if (n->left)
+    n->left->SetParent(n);
+  if (n->right)
+    n->right->SetParent(n);
+  Update(n);
+}
+
+template <typename K, typename V, typename B>
+unsigned int Multi_Map<K, V, B>::Count(Node *n) {
+  return n ? n->count : 0;
+}
+
+// Recompute the subtree count of @n from its children
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Update(Node *n) {
+  n->count = n->values.size() + Count(n->left) + Count(n->right);
+}
+
+// Adjust the counts from @n up to the root after values changed in place
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::AddCount(Node *n, int delta) {
+  for (; n; n = n->Parent())
+    n->count += delta;
+}
+
+template <typename K, typename V, typename B>
+unsigned int Multi_Map<K, V, B>::Rank(const K &key) {
+  return Rank(key, false);
+}
+
+// Count the values before @key, or up to and including it if @inclusive
+template <typename K, typename V, typename B>
+unsigned int Multi_Map<K, V, B>::Rank(const K &key, bool inclusive) {
+  unsigned int rank = 0;
+  for (Node *n = root; n;) {
+    if (n->key < key || (inclusive && n->key == key)) {
+      rank += Count(n->left) + n->values.size();
+      n = n->right;
+    } else {
+      n = n->left;
+    }
+  }
+  return rank;
+}
+
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::iterator Multi_Map<K, V, B>::Select(unsigned int i) {
+  if (i >= cur_size)
+    return end();
+  Node *n = root;
+  while (true) {
+    unsigned int left = Count(n->left);
+    if (i < left) {
+      n = n->left;
+    } else if (i - left < n->values.size()) {
+      return iterator(this, n, i - left);
+    } else {
+      i -= left + n->values.size();
+      n = n->right;
+    }
+  }
+}
+
+template <typename K, typename V, typename B>
+unsigned int Multi_Map<K, V, B>::CountRange(const K &lo, const K &hi) {
+  if (hi < lo)
+    return 0;
+  return Rank(hi, true) - Rank(lo, false);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Join(Multi_Map &other) {
+  if (&other == this)
+    throw std::runtime_error("Error: cannot join a map with itself");
+  if (tombstones > 0)
+    Compact();
+  if (other.tombstones > 0)
+    other.Compact();
+  if (root && other.root && !(MaxNode()->key < other.leftmost->key))
+    throw std::runtime_error("Error: joined keys must all exceed ours");
+  Node *r = Adopt(other);
+  if (r) {
+    Node *m = PopMinNode(r);
+    root = Join(Detach(root), m, r);
+  }
+  BulkContext ctx{nullptr};
+  FinishBulk(ctx);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Split(const K &key, Multi_Map &right) {
+  if (&right == this)
+    throw std::runtime_error("Error: cannot split a map into itself");
+  if (tombstones > 0)
+    Compact();
+  right.Clear();
+  Node *l, *m, *r;
+  Split(Detach(root), key, l, m, r);
+  if (m)
+    r = Join(nullptr, m, r);
+  root = l;
+  BulkContext ctx{nullptr};
+  FinishBulk(ctx);
+
+  // The upper part still sits in our pool, so @right copies it into its
+  // own and builds it back up in O(k)
+  std::size_t nodes = 0;
+  Node *copies = nullptr;
+  Node **tail = &copies;
+  for (Node *n = TreeToVine(r); n; nodes++) {
+    Node *next = n->right;
+    Node *c = right.NewNode(BLACK, n->key, std::move(n->values.front()));
+    for (std::size_t i = 1; i < n->values.size(); i++)
+      c->values.push_back(std::move(n->values[i]));
+    *tail = c;
+    tail = &c->right;
+    DeleteNode(n);
+    n = next;
+  }
+  auto next = [&]() {
+    Node *c = copies;
+    copies = copies->right;
+    return c;
+  };
+  right.root = right.Build(nodes, next);
+  right.leftmost = right.root ? right.Min(right.root) : nullptr;
+  right.cur_size = Count(right.root);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Union(Multi_Map &other, ForkJoinPool &pool) {
+  if (&other == this)
+    throw std::runtime_error("Error: cannot union a map with itself");
+  if (tombstones > 0)
+    Compact();
+  if (other.tombstones > 0)
+    other.Compact();
+  BulkContext ctx{&pool};
+  // The counters are plain integers, so counted runs stay on one thread
+  MULTI_MAP_STATS(ctx.pool = nullptr;)
+  Node *b = Adopt(other);
+  root = Union(Detach(root), b, ctx);
+  FinishBulk(ctx);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Intersect(Multi_Map &other, ForkJoinPool &pool) {
+  if (&other == this)
+    return;
+  if (tombstones > 0)
+    Compact();
+  BulkContext ctx{&pool};
+  MULTI_MAP_STATS(ctx.pool = nullptr;)
+  root = Intersect(Detach(root), other.root, ctx);
+  FinishBulk(ctx);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Difference(Multi_Map &other, ForkJoinPool &pool) {
+  if (&other == this) {
+    Clear();
+    return;
+  }
+  if (tombstones > 0)
+    Compact();
+  BulkContext ctx{&pool};
+  MULTI_MAP_STATS(ctx.pool = nullptr;)
+  root = Difference(Detach(root), other.root, ctx);
+  FinishBulk(ctx);
+}
+
+template <typename K, typename V, typename B>
+unsigned int Multi_Map<K, V, B>::EraseRange(const K &lo, const K &hi) {
+  if (hi < lo || !root)
+    return 0;
+  if (tombstones > 0)
+    Compact();
+  BulkContext ctx{nullptr};
+  Node *l, *lo_node, *rest, *mid, *hi_node, *r;
+  Split(Detach(root), lo, l, lo_node, rest);
+  Split(rest, hi, mid, hi_node, r);
+  unsigned int erased = Count(lo_node) + Count(mid) + Count(hi_node);
+  if (lo_node)
+    Discard(ctx, lo_node);
+  if (hi_node)
+    Discard(ctx, hi_node);
+  DiscardTree(ctx, mid);
+  root = Join(l, r);
+  FinishBulk(ctx);
+  return erased;
+}
+
+// Make @n the black, parentless root of a tree of its own
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Detach(Node *n) {
+  if (n) {
+    n->SetParent(nullptr);
+    n->SetColor(BLACK);
+  }
+  return n;
+}
+
+// Count the black nodes on the way down to a leaf, @n included
+template <typename K, typename V, typename B>
+int Multi_Map<K, V, B>::BlackHeight(Node *n) {
+  int h = 0;
+  for (; n; n = n->left)
+    h += !IsRed(n);
+  return h;
+}
+
+// Link @l, the lone node @m and @r, keys in that order, into one tree:
+// @m goes in red where the spine of the taller side reaches the black
+// height of the shorter one, and the spine is fixed up as after an insert
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Join(Node *l, Node *m, Node *r) {
+  int hl = BlackHeight(l), hr = BlackHeight(r);
+  if (hl == hr) {
+    m->left = l;
+    m->right = r;
+    SetParents(m);
+    return Detach(m);
+  }
+  Node **path[kMaxDepth];
+  int depth = 0;
+  Node *top, *parent = nullptr;
+  Node **link;
+  if (hl > hr) {
+    // Right spine nodes of an LLRB are all black
+    top = l;
+    link = &top;
+    for (int h = hl; h > hr; h--) {
+      path[depth++] = link;
+      parent = *link;
+      link = &parent->right;
+    }
+    m->left = *link;
+    m->right = r;
+  } else {
+    top = r;
+    link = &top;
+    for (int h = hr; *link && (IsRed(*link) || h > hl);) {
+      if (!IsRed(*link))
+        h--;
+      path[depth++] = link;
+      parent = *link;
+      link = &parent->left;
+    }
+    m->left = l;
+    m->right = *link;
+  }
+  m->SetColor(RED);
+  m->SetParent(parent);
+  SetParents(m);
+  *link = m;
+  while (depth > 0) {
+    Node **q = path[--depth];
+    FixUp(*q);
+    Update(*q);
+  }
+  return Detach(top);
+}
+
+// Link @l and @r, keys in that order, into one tree
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Join(Node *l, Node *r) {
+  if (!r)
+    return l;
+  Node *m = PopMinNode(r);
+  return Join(l, m, r);
+}
+
+// Unhook the min node of the tree at @top and return it
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::PopMinNode(Node *&top) {
+  Node **path[kMaxDepth];
+  int depth = 0;
+  Node *n = UnlinkMin(&top, path, depth);
+  while (depth > 0) {
+    Node **l = path[--depth];
+    FixUp(*l);
+    Update(*l);
+  }
+  Detach(top);
+  n->left = n->right = nullptr;
+  Update(n);
+  return n;
+}
+
+// Cut the tree at @t into the keys below @key in @l, the node holding
+// @key, if any, in @m and the keys above it in @r
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Split(Node *t, const K &key, Node *&l, Node *&m, Node *&r) {
+  if (!t) {
+    l = m = r = nullptr;
+    return;
+  }
+  Node *tl = Detach(t->left), *tr = Detach(t->right);
+  if (key < t->key) {
+    Split(tl, key, l, m, r);
+    r = Join(r, t, tr);
+  } else if (t->key < key) {
+    Split(tr, key, l, m, r);
+    l = Join(tl, t, l);
+  } else {
+    l = tl;
+    r = tr;
+    t->left = t->right = nullptr;
+    Update(t);
+    m = Detach(t);
+  }
+}
+
+// Split @b around the root key of @a and merge the halves in parallel
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Union(Node *a, Node *b, BulkContext &ctx) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  unsigned int work = Count(a) + Count(b);
+  Node *al = Detach(a->left), *ar = Detach(a->right);
+  Node *bl, *bm, *br;
+  Split(b, a->key, bl, bm, br);
+  if (bm) {
+    for (V &v : bm->values)
+      a->values.push_back(std::move(v));
+    Discard(ctx, bm);
+  }
+  Node *l, *r;
+  Fork(ctx, work, [&] { l = Union(al, bl, ctx); }, [&] { r = Union(ar, br, ctx); });
+  return Join(l, a, r);
+}
 
+// Split @a around each key of the read-only @b, keeping the shared ones
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Intersect(Node *a, Node *b, BulkContext &ctx) {
+  if (!a)
+    return nullptr;
+  if (!b) {
+    DiscardTree(ctx, a);
+    return nullptr;
+  }
+  unsigned int work = Count(a) + Count(b);
+  Node *al, *am, *ar;
+  Split(a, b->key, al, am, ar);
+  // A tombstone in @b does not hold its key
+  if (am && b->values.empty()) {
+    Discard(ctx, am);
+    am = nullptr;
+  }
+  Node *l, *r;
+  Fork(ctx, work, [&] { l = Intersect(al, b->left, ctx); },
+       [&] { r = Intersect(ar, b->right, ctx); });
+  return am ? Join(l, am, r) : Join(l, r);
+}
+
+// Split @a around each key of the read-only @b, dropping the shared ones
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Difference(Node *a, Node *b, BulkContext &ctx) {
+  if (!a || !b)
+    return a;
+  unsigned int work = Count(a) + Count(b);
+  Node *al, *am, *ar;
+  Split(a, b->key, al, am, ar);
+  if (am && !b->values.empty()) {
+    Discard(ctx, am);
+    am = nullptr;
+  }
+  Node *l, *r;
+  Fork(ctx, work, [&] { l = Difference(al, b->left, ctx); },
+       [&] { r = Difference(ar, b->right, ctx); });
+  return am ? Join(l, am, r) : Join(l, r);
+}
+
+// Run @a and @c, on the pool when there is enough @work to share
+template <typename K, typename V, typename B>
+template <typename A, typename C>
+void Multi_Map<K, V, B>::Fork(BulkContext &ctx, unsigned int work, A a, C c) {
+  if (ctx.pool && work >= kForkCutoff) {
+    ctx.pool->Invoke(a, c);
+  } else {
+    a();
+    c();
+  }
+}
+
+// Queue @n to be freed once the tasks are done; the pool is not shared
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Discard(BulkContext &ctx, Node *n) {
+  n->left = ctx.dead.load(std::memory_order_relaxed);
+  while (!ctx.dead.compare_exchange_weak(n->left, n, std::memory_order_relaxed)) {
+  }
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::DiscardTree(BulkContext &ctx, Node *n) {
+  for (n = TreeToVine(n); n;) {
+    Node *next = n->right;
+    Discard(ctx, n);
+    n = next;
+  }
+}
+
+// Take over the nodes of @other, leaving it empty, and return its tree
+template <typename K, typename V, typename B>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::Adopt(Multi_Map &other) {
+  Node *t = Detach(other.root);
+  pool.Absorb(other.pool);
+  if constexpr (kHashIndex) {
+    for (Node *n = other.leftmost; n; n = Next(n))
+      index.Insert(n);
+    other.index.Clear();
+  }
+  other.root = nullptr;
+  other.leftmost = nullptr;
+  other.cur_size = 0;
+  return t;
+}
+
+// Free the discarded nodes and refresh the cached min and size
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::FinishBulk(BulkContext &ctx) {
+  for (Node *n = ctx.dead.load(); n;) {
+    Node *next = n->left;
+    DeleteNode(n);
+    n = next;
+  }
+  ctx.dead.store(nullptr);
+  Detach(root);
+  leftmost = root ? Min(root) : nullptr;
+  cur_size = Count(root);
+}
+
+template <typename K, typename V, typename B>
+MultiMapStats Multi_Map<K, V, B>::Stats() {
+  MultiMapStats s;
+  MULTI_MAP_STATS(s = stats;)
+  MULTI_MAP_STATS(s.lookups = lookup_stats.lookups.load(std::memory_order_relaxed);)
+  MULTI_MAP_STATS(s.lookup_depth = lookup_stats.depth.load(std::memory_order_relaxed);)
+  MULTI_MAP_STATS(s.max_lookup_depth = lookup_stats.max_depth.load(std::memory_order_relaxed);)
+  MULTI_MAP_STATS(s.size = cur_size;)
+  return s;
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::ResetStats() {
+  MULTI_MAP_STATS(stats = MultiMapStats();)
+  MULTI_MAP_STATS(lookup_stats.lookups.store(0, std::memory_order_relaxed);)
+  MULTI_MAP_STATS(lookup_stats.depth.store(0, std::memory_order_relaxed);)
+  MULTI_MAP_STATS(lookup_stats.max_depth.store(0, std::memory_order_relaxed);)
+}
+
+template <typename K, typename V, typename B>
+template <typename... Args>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::NewNode(Args&&... args) {
+  MULTI_MAP_STATS(stats.node_allocations++;)
+  Node *n = pool.New(std::forward<Args>(args)...);
+  if constexpr (kHashIndex) {
+    try {
+      index.Insert(n);
+    } catch (...) {
+      pool.Delete(n);
+      throw;
+    }
+  }
+  return n;
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::DeleteNode(Node *n) {
+  if constexpr (kHashIndex)
+    index.Erase(n);
+  pool.Delete(n);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::CountDuplicate(Node *n) {
+  MULTI_MAP_STATS(stats.duplicate_appends++;)
+  MULTI_MAP_STATS(stats.max_duplicates = std::max<unsigned int>(stats.max_duplicates, n->values.size());)
+  (void)n;
+}
+
+// Build, in order, a subtree of @count nodes whose 2-3 leaves all sit at
+// the depth where a tree can hold at most @max_count keys. Children are
+// split as evenly as possible, which keeps every count within range.
+template <typename K, typename V, typename B>
+template <typename NextNode>
+typename Multi_Map<K, V, B>::Node* Multi_Map<K, V, B>::BuildSubtree(std::size_t count,
+                                                                    std::size_t max_count,
+                                                                    NextNode &next) {
+  if (count == 0)
+    return nullptr;
+  std::size_t child_max = (max_count + 1) / 3 - 1;
+
+  // 2-node when two children can hold the rest
+  if (count - 1 <= 2 * child_max) {
+    std::size_t left = (count - 1) / 2;
+    Node *l = BuildSubtree(left, child_max, next);
+    Node *n = next();
+    n->left = l;
+    n->right = BuildSubtree(count - 1 - left, child_max, next);
+    SetParents(n);
+    return n;
+  }
+
+  // 3-node: a red left child holds the smaller key
+  std::size_t rest = count - 2;
+  std::size_t a = rest / 3;
+  std::size_t b = (rest - a) / 2;
+  Node *l = BuildSubtree(a, child_max, next);
+  Node *red = next();
+  red->SetColor(RED);
+  red->left = l;
+  red->right = BuildSubtree(b, child_max, next);
+  SetParents(red);
+  Node *n = next();
+  n->left = red;
+  n->right = BuildSubtree(rest - a - b, child_max, next);
+  SetParents(n);
+  return n;
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Print() {
+  StreamSink sink(std::cout);
+  Dump(sink, DumpFormat::kText);
+  std::cout << std::endl;
+}
+
+template <typename K, typename V, typename B>
+template <typename F>
+void Multi_Map<K, V, B>::ForEach(F f) {
+  for (Node *n = leftmost; n; n = NextLive(n))
+    for (V &v : n->values)
+      f(static_cast<const K&>(n->key), v);
+}
+
+template <typename K, typename V, typename B>
+void Multi_Map<K, V, B>::Dump(DumpSink &sink, DumpFormat format) {
+  DumpWriter<K, V> out(sink, format);
+  ForEach([&](const K &key, const V &value) { out.Pair(key, value); });
+  out.Finish();
+}
+
+#endif  // MULTI_MAP_H_
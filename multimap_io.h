@@ -0,0 +1,303 @@
+#ifndef MULTIMAP_IO_H_
+#define MULTIMAP_IO_H_
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Byte encoding of keys and values for Serialize/Deserialize
+// Trivially copyable types are written as their raw bytes and strings as a
+// length followed by the characters; specialize this for other types.
+template <typename T, typename Enable = void>
+struct MultiMapCodec;
+
+template <typename T>
+struct MultiMapCodec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static void Write(std::ostream &out, const T &x) {
+    out.write(reinterpret_cast<const char *>(&x), sizeof(T));
+  }
+  static bool Read(std::istream &in, T &x) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&x), sizeof(T)));
+  }
+};
+
+template <typename C, typename Tr, typename A>
+struct MultiMapCodec<std::basic_string<C, Tr, A>> {
+  static void Write(std::ostream &out, const std::basic_string<C, Tr, A> &x) {
+    uint64_t n = x.size();
+    out.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    out.write(reinterpret_cast<const char *>(x.data()), n * sizeof(C));
+  }
+  // The length comes from the stream, so the string only grows as the
+  // characters actually arrive; a corrupt length fails at the end of the
+  // input rather than asking for the memory up front
+  static bool Read(std::istream &in, std::basic_string<C, Tr, A> &x) {
+    constexpr uint64_t kChunk = (1 << 16) / sizeof(C);
+    uint64_t n;
+    if (!in.read(reinterpret_cast<char *>(&n), sizeof(n)))
+      return false;
+    x.clear();
+    while (n > 0) {
+      std::size_t step = static_cast<std::size_t>(n < kChunk ? n : kChunk);
+      std::size_t old = x.size();
+      x.resize(old + step);
+      if (!in.read(reinterpret_cast<char *>(&x[old]), step * sizeof(C)))
+        return false;
+      n -= step;
+    }
+    return true;
+  }
+};
+
+// Output formats of Dump
+// kText is what Print() shows, a "key: [values] " line per key; kCsv is a
+// key,value header and a row per pair; kJson an array of [key, value]
+// pairs; kBinary each key and value back to back as MultiMapCodec writes
+// them, with no header.
+enum class DumpFormat { kText, kCsv, kJson, kBinary };
+
+// Destination of a dump, handed the formatted output in large blocks
+class DumpSink {
+ public:
+  virtual ~DumpSink() = default;
+  virtual void Write(const char *data, std::size_t size) = 0;
+};
+
+// Sink appending to an std::ostream
+class StreamSink : public DumpSink {
+ public:
+  explicit StreamSink(std::ostream &out) : out_(out) {}
+  void Write(const char *data, std::size_t size) override {
+    if (!out_.write(data, size))
+      throw std::runtime_error("Error: cannot write dump");
+  }
+
+ private:
+  std::ostream &out_;
+};
+
+// Sink appending to a stdio stream
+class FileSink : public DumpSink {
+ public:
+  explicit FileSink(std::FILE *file) : file_(file) {}
+  void Write(const char *data, std::size_t size) override {
+    if (std::fwrite(data, 1, size, file_) != size)
+      throw std::runtime_error("Error: cannot write dump");
+  }
+
+ private:
+  std::FILE *file_;
+};
+
+// Formats (key, value) pairs into one reusable buffer and hands it to a
+// sink each time it fills, so a dump costs one write per block rather
+// than a flush per line. Pairs must arrive in key order for kText to
+// group duplicates; call Finish() once after the last one.
+template <typename K, typename V>
+class DumpWriter : private std::streambuf {
+ public:
+  static constexpr std::size_t kBufferSize = 1 << 20;
+
+  DumpWriter(DumpSink &sink, DumpFormat format, std::size_t buffer_size = kBufferSize)
+      : sink_(sink), format_(format), buffer_(buffer_size ? buffer_size : 1), out_(this) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    // Let a failing sink's exception through the stream formatting
+    out_.exceptions(std::ios::badbit);
+    if (format_ == DumpFormat::kCsv)
+      Append("key,value\n");
+    else if (format_ == DumpFormat::kJson)
+      Append("[");
+  }
+
+  DumpWriter(const DumpWriter &) = delete;
+  DumpWriter &operator=(const DumpWriter &) = delete;
+
+  // Add one pair
+  void Pair(const K &key, const V &value);
+  // Close the output and pass on whatever is still buffered
+  void Finish();
+
+ private:
+  int overflow(int c) override {
+    Flush();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  void Flush() {
+    if (pptr() > pbase())
+      sink_.Write(pbase(), pptr() - pbase());
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+  void Append(const char *s, std::size_t n) {
+    if (n <= static_cast<std::size_t>(epptr() - pptr())) {
+      std::memcpy(pptr(), s, n);
+      pbump(static_cast<int>(n));
+      return;
+    }
+    Flush();
+    if (n >= buffer_.size())
+      sink_.Write(s, n);
+    else
+      Append(s, n);
+  }
+  void Append(const char *s) { Append(s, std::strlen(s)); }
+
+  template <typename T>
+  void Field(const T &x);
+  // Write the characters of a string or non-numeric field
+  void Text(const char *s, std::size_t n);
+
+  DumpSink &sink_;
+  DumpFormat format_;
+  std::vector<char> buffer_;
+  std::ostream out_;        // over buffer_, for codecs and operator<<
+  std::optional<K> last_;   // key of the open kText line
+  bool first_ = true;
+};
+
+template <typename K, typename V>
+void DumpWriter<K, V>::Pair(const K &key, const V &value) {
+  switch (format_) {
+    case DumpFormat::kText:
+      if (last_ && *last_ == key) {
+        Append(", ");
+      } else {
+        if (last_)
+          Append("] \n");
+        Field(key);
+        Append(": [");
+        last_ = key;
+      }
+      Field(value);
+      break;
+    case DumpFormat::kCsv:
+      Field(key);
+      Append(",");
+      Field(value);
+      Append("\n");
+      break;
+    case DumpFormat::kJson:
+      Append(first_ ? "\n[" : ",\n[");
+      Field(key);
+      Append(",");
+      Field(value);
+      Append("]");
+      break;
+    case DumpFormat::kBinary:
+      MultiMapCodec<K>::Write(out_, key);
+      MultiMapCodec<V>::Write(out_, value);
+      break;
+  }
+  first_ = false;
+}
+
+template <typename K, typename V>
+void DumpWriter<K, V>::Finish() {
+  if (format_ == DumpFormat::kText && last_)
+    Append("] \n");
+  else if (format_ == DumpFormat::kJson)
+    Append(first_ ? "]\n" : "\n]\n");
+  last_.reset();
+  Flush();
+}
+
+// Integers are formatted by hand in every format, floats only where
+// operator<< would not match Print(); everything else goes through it
+template <typename K, typename V>
+template <typename T>
+void DumpWriter<K, V>::Field(const T &x) {
+  constexpr bool kChar = std::is_same<T, char>::value || std::is_same<T, signed char>::value ||
+                         std::is_same<T, unsigned char>::value;
+  if constexpr (std::is_integral<T>::value && !std::is_same<T, bool>::value && !kChar) {
+    char tmp[24];
+    Append(tmp, std::to_chars(tmp, tmp + sizeof(tmp), x).ptr - tmp);
+  } else if constexpr (std::is_same<T, std::string>::value) {
+    if (format_ == DumpFormat::kText)
+      Append(x.data(), x.size());
+    else
+      Text(x.data(), x.size());
+  } else if constexpr (std::is_floating_point<T>::value) {
+    if (format_ == DumpFormat::kText) {
+      out_ << x;
+    } else if (!std::isfinite(x)) {
+      Append(format_ == DumpFormat::kJson ? "null" : "");
+    } else {
+      char tmp[64];
+      Append(tmp, std::to_chars(tmp, tmp + sizeof(tmp), x).ptr - tmp);
+    }
+  } else if constexpr (std::is_same<T, bool>::value) {
+    if (format_ == DumpFormat::kText)
+      out_ << x;
+    else
+      Append(x ? "true" : "false");
+  } else {
+    if (format_ == DumpFormat::kText) {
+      out_ << x;
+      return;
+    }
+    std::ostringstream s;
+    s << x;
+    std::string str = s.str();
+    Text(str.data(), str.size());
+  }
+}
+
+template <typename K, typename V>
+void DumpWriter<K, V>::Text(const char *s, std::size_t n) {
+  if (format_ == DumpFormat::kCsv) {
+    // Quote only fields that need it, doubling embedded quotes
+    bool plain = true;
+    for (std::size_t i = 0; i < n && plain; i++)
+      plain = s[i] != ',' && s[i] != '"' && s[i] != '\r' && s[i] != '\n';
+    if (plain) {
+      Append(s, n);
+      return;
+    }
+    Append("\"");
+    for (const char *q = s; q < s + n;) {
+      const char *quote = static_cast<const char *>(std::memchr(q, '"', s + n - q));
+      const char *upto = quote ? quote + 1 : s + n;
+      Append(q, upto - q);
+      if (quote)
+        Append("\"");
+      q = upto;
+    }
+    Append("\"");
+    return;
+  }
+  Append("\"");
+  const char *run = s;
+  for (const char *q = s; q < s + n; q++) {
+    unsigned char c = static_cast<unsigned char>(*q);
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    Append(run, q - run);
+    run = q + 1;
+    char esc[8] = {'\\', static_cast<char>(c), 0};
+    if (c == '\n') esc[1] = 'n';
+    else if (c == '\t') esc[1] = 't';
+    else if (c == '\r') esc[1] = 'r';
+    else if (c < 0x20) std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+    Append(esc);
+  }
+  Append(run, s + n - run);
+  Append("\"");
+}
+
+#endif  // MULTIMAP_IO_H_
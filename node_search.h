@@ -0,0 +1,203 @@
+#ifndef NODE_SEARCH_H_
+#define NODE_SEARCH_H_
+
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NODE_SEARCH_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#define NODE_SEARCH_SSE 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NODE_SEARCH_NEON 1
+#endif
+
+
+// Position search inside the sorted key array of a wide node
+// Arithmetic keys are compared against every slot with SIMD and the lanes
+// that sort before @key are counted, so the result never depends on a
+// branch the predictor has to guess. Other keys, and lane types the target
+// has no compare for, use a branchless binary search.
+template <typename K>
+struct NodeSearch {
+  // Index of the first key not less than @key
+  static unsigned LowerBound(const K *keys, unsigned n, const K &key) {
+    return Search<false>(keys, n, key);
+  }
+  // Index of the first key greater than @key
+  static unsigned UpperBound(const K *keys, unsigned n, const K &key) {
+    return Search<true>(keys, n, key);
+  }
+
+ private:
+  static constexpr bool kFloat =
+      std::is_same<K, float>::value || std::is_same<K, double>::value;
+  static constexpr bool kInt = std::is_integral<K>::value &&
+                               std::is_signed<K>::value &&
+                               (sizeof(K) == 4 || sizeof(K) == 8);
+#if defined(NODE_SEARCH_AVX2) || defined(NODE_SEARCH_NEON)
+  static constexpr bool kVector = kFloat || kInt;
+#elif defined(NODE_SEARCH_SSE) && defined(__SSE4_2__)
+  static constexpr bool kVector = kFloat || kInt;
+#elif defined(NODE_SEARCH_SSE)
+  // 64-bit integer compares need SSE4.2
+  static constexpr bool kVector = kFloat || (kInt && sizeof(K) == 4);
+#else
+  static constexpr bool kVector = false;
+#endif
+
+  // Whether @x sorts before the search position for @key
+  template <bool Upper>
+  static bool Before(const K &x, const K &key) {
+    return Upper ? !(key < x) : x < key;
+  }
+
+  template <bool Upper>
+  static unsigned Search(const K *keys, unsigned n, const K &key) {
+    if constexpr (kVector) {
+      unsigned i = 0;
+      unsigned c = VectorCount<Upper>(keys, n, key, i);
+      for (; i < n; i++)
+        c += Before<Upper>(keys[i], key);
+      return c;
+    } else {
+      return Bisect<Upper>(keys, n, key);
+    }
+  }
+
+  // Halve the range with a conditional move instead of a branch
+  template <bool Upper>
+  static unsigned Bisect(const K *keys, unsigned n, const K &key) {
+    if (n == 0)
+      return 0;
+    const K *base = keys;
+    while (n > 1) {
+      unsigned half = n / 2;
+      base = Before<Upper>(base[half], key) ? base + half : base;
+      n -= half;
+    }
+    return static_cast<unsigned>(base - keys) + Before<Upper>(*base, key);
+  }
+
+  // Count whole vectors of keys sorting before @key, advancing @i past them
+  template <bool Upper>
+  static unsigned VectorCount(const K *keys, unsigned n, K key, unsigned &i) {
+    unsigned c = 0;
+#if defined(NODE_SEARCH_AVX2)
+    if constexpr (std::is_same<K, float>::value) {
+      __m256 k = _mm256_set1_ps(key);
+      for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_loadu_ps(keys + i);
+        c += __builtin_popcount(_mm256_movemask_ps(
+            _mm256_cmp_ps(d, k, Upper ? _CMP_LE_OQ : _CMP_LT_OQ)));
+      }
+    } else if constexpr (std::is_same<K, double>::value) {
+      __m256d k = _mm256_set1_pd(key);
+      for (; i + 4 <= n; i += 4) {
+        __m256d d = _mm256_loadu_pd(keys + i);
+        c += __builtin_popcount(_mm256_movemask_pd(
+            _mm256_cmp_pd(d, k, Upper ? _CMP_LE_OQ : _CMP_LT_OQ)));
+      }
+    } else if constexpr (sizeof(K) == 4) {
+      __m256i k = _mm256_set1_epi32(key);
+      for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(
+            Upper ? _mm256_cmpgt_epi32(d, k) : _mm256_cmpgt_epi32(k, d)));
+        c += Upper ? 8 - __builtin_popcount(m) : __builtin_popcount(m);
+      }
+    } else {
+      __m256i k = _mm256_set1_epi64x(key);
+      for (; i + 4 <= n; i += 4) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        int m = _mm256_movemask_pd(_mm256_castsi256_pd(
+            Upper ? _mm256_cmpgt_epi64(d, k) : _mm256_cmpgt_epi64(k, d)));
+        c += Upper ? 4 - __builtin_popcount(m) : __builtin_popcount(m);
+      }
+    }
+#elif defined(NODE_SEARCH_SSE)
+    if constexpr (std::is_same<K, float>::value) {
+      __m128 k = _mm_set1_ps(key);
+      for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_loadu_ps(keys + i);
+        c += __builtin_popcount(
+            _mm_movemask_ps(Upper ? _mm_cmple_ps(d, k) : _mm_cmplt_ps(d, k)));
+      }
+    } else if constexpr (std::is_same<K, double>::value) {
+      __m128d k = _mm_set1_pd(key);
+      for (; i + 2 <= n; i += 2) {
+        __m128d d = _mm_loadu_pd(keys + i);
+        c += __builtin_popcount(
+            _mm_movemask_pd(Upper ? _mm_cmple_pd(d, k) : _mm_cmplt_pd(d, k)));
+      }
+    } else if constexpr (sizeof(K) == 4) {
+      __m128i k = _mm_set1_epi32(key);
+      for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        int m = _mm_movemask_ps(_mm_castsi128_ps(
+            Upper ? _mm_cmpgt_epi32(d, k) : _mm_cmpgt_epi32(k, d)));
+        c += Upper ? 4 - __builtin_popcount(m) : __builtin_popcount(m);
+      }
+    } else {
+#if defined(__SSE4_2__)
+      __m128i k = _mm_set1_epi64x(key);
+      for (; i + 2 <= n; i += 2) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        int m = _mm_movemask_pd(_mm_castsi128_pd(
+            Upper ? _mm_cmpgt_epi64(d, k) : _mm_cmpgt_epi64(k, d)));
+        c += Upper ? 2 - __builtin_popcount(m) : __builtin_popcount(m);
+      }
+#endif
+    }
+#elif defined(NODE_SEARCH_NEON)
+    // Compare lanes are all ones, so subtracting them counts matches
+    if constexpr (std::is_same<K, float>::value) {
+      float32x4_t k = vdupq_n_f32(key);
+      uint32x4_t acc = vdupq_n_u32(0);
+      for (; i + 4 <= n; i += 4) {
+        float32x4_t d = vld1q_f32(keys + i);
+        acc = vsubq_u32(acc, Upper ? vcleq_f32(d, k) : vcltq_f32(d, k));
+      }
+      c = vaddvq_u32(acc);
+    } else if constexpr (std::is_same<K, double>::value) {
+      float64x2_t k = vdupq_n_f64(key);
+      uint64x2_t acc = vdupq_n_u64(0);
+      for (; i + 2 <= n; i += 2) {
+        float64x2_t d = vld1q_f64(keys + i);
+        acc = vsubq_u64(acc, Upper ? vcleq_f64(d, k) : vcltq_f64(d, k));
+      }
+      c = static_cast<unsigned>(vaddvq_u64(acc));
+    } else if constexpr (sizeof(K) == 4) {
+      int32x4_t k = vdupq_n_s32(key);
+      uint32x4_t acc = vdupq_n_u32(0);
+      for (; i + 4 <= n; i += 4) {
+        int32x4_t d = vld1q_s32(reinterpret_cast<const int32_t*>(keys + i));
+        acc = vsubq_u32(acc, Upper ? vcleq_s32(d, k) : vcltq_s32(d, k));
+      }
+      c = vaddvq_u32(acc);
+    } else {
+      int64x2_t k = vdupq_n_s64(key);
+      uint64x2_t acc = vdupq_n_u64(0);
+      for (; i + 2 <= n; i += 2) {
+        int64x2_t d = vld1q_s64(reinterpret_cast<const int64_t*>(keys + i));
+        acc = vsubq_u64(acc, Upper ? vcleq_s64(d, k) : vcltq_s64(d, k));
+      }
+      c = static_cast<unsigned>(vaddvq_u64(acc));
+    }
+#else
+    (void)keys;
+    (void)n;
+    (void)key;
+    (void)i;
+#endif
+    return c;
+  }
+};
+
+#endif  // NODE_SEARCH_H_
@@ -0,0 +1,462 @@
+#ifndef PERSISTENT_MULTIMAP_H_
+#define PERSISTENT_MULTIMAP_H_
+
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "multimap.h"
+
+// Backend policy for a persistent, path-copying red-black tree
+struct PersistentBackend {};
+
+// Persistent Multi-Map implementation using a left-leaning red-black tree
+// Nodes are reference counted and shared between versions. An update
+// copies only the nodes on its path that some other version still
+// references and changes the rest in place, so with no snapshots alive it
+// costs about what the plain tree does. Snapshot() is O(1): it takes a
+// reference on the current root, after which neither side can see the
+// other's changes. Updates and Snapshot() belong to one writer thread at a
+// time; snapshots may be read, copied and dropped on any thread, and whoever
+// drops the last reference to a node frees it.
+template <typename K, typename V>
+class Multi_Map<K, V, PersistentBackend> {
+  struct Node;
+
+ public:
+  // Immutable view of the map as of one Snapshot() call
+  class Version {
+   public:
+    Version() = default;
+    Version(const Version &other) : root_(Ref(other.root_)) {}
+    Version(Version &&other) noexcept : root_(other.root_) { other.root_ = nullptr; }
+    Version &operator=(Version other) noexcept {
+      std::swap(root_, other.root_);
+      return *this;
+    }
+    ~Version() { Unref(root_); }
+
+    // Return number of values in the version
+    unsigned int Size() const { return Count(root_); }
+    // Return the first value associated to @key
+    const V& Get(const K &key) const { return Multi_Map::Get(root_, key); }
+    // Return whether @key is found in the version
+    bool Contains(const K &key) const { return Find(root_, key) != nullptr; }
+    // Return min key in the version
+    const K& Min() const { return MinNode(root_)->key; }
+    // Return max key in the version
+    const K& Max() const { return MaxNode(root_)->key; }
+    // Call @f(key, value) for every pair in key order
+    template <typename F>
+    void ForEach(F f) const { Multi_Map::ForEach(root_, f); }
+    // Write every pair to @sink in @format; the live map can keep changing
+    // on its own thread meanwhile
+    void Dump(DumpSink &sink, DumpFormat format = DumpFormat::kText) const {
+      Multi_Map::Dump(root_, sink, format);
+    }
+
+   private:
+    friend class Multi_Map;
+    explicit Version(Node *root) : root_(root) {}
+
+    Node *root_ = nullptr;
+  };
+
+  // Constructor
+  Multi_Map() = default;
+
+  // Destructor
+  ~Multi_Map() {
+    Clear();
+  }
+
+  // Versions share nodes through Snapshot() only
+  Multi_Map(const Multi_Map &) = delete;
+  Multi_Map &operator=(const Multi_Map &) = delete;
+
+  // Return size of tree
+  unsigned int Size() { return Count(root_); }
+  // Return value associated to @key
+  const V& Get(const K &key) { return Get(root_, key); }
+  // Return whether @key is found in tree
+  bool Contains(const K &key) { return Find(root_, key) != nullptr; }
+  // Return max key in tree
+  const K& Max() { return MaxNode(root_)->key; }
+  // Return min key in tree
+  const K& Min() { return MinNode(root_)->key; }
+  // Remove and return the first value of the min key
+  V PopMin();
+  // Insert @key in tree
+  void Insert(const K &key, const V &value);
+  // Remove the first value of @key, return whether anything was removed
+  bool Remove(const K &key);
+  // Remove every key; snapshots keep what they reference
+  void Clear();
+  // Print tree in-order
+  void Print();
+  // Write every pair to @sink in @format, through one large buffer
+  void Dump(DumpSink &sink, DumpFormat format = DumpFormat::kText) { Dump(root_, sink, format); }
+  // Return an immutable view of the current contents in O(1)
+  Version Snapshot() { return Version(Ref(root_)); }
+
+ private:
+  enum Color { RED, BLACK };
+  static constexpr unsigned kInlineValues = Multi_Map<K, V>::kInlineValues;
+
+  struct Node {
+    K key;
+    ValueList<V, kInlineValues> values;
+    Node *left = nullptr;
+    Node *right = nullptr;
+    unsigned int count = 1;  // values in this subtree, duplicates included
+    bool color;
+    std::atomic<unsigned int> refs{1};  // parents and snapshots holding it
+
+    Node(bool color, const K &key, const V &value) : key(key), color(color) {
+      values.push_back(value);
+    }
+    // Private copy for a writer; the caller takes references on the children
+    Node(const Node &other)
+        : key(other.key), values(other.values), left(other.left),
+          right(other.right), count(other.count), color(other.color) {}
+  };
+
+  static Node* Ref(Node *n);
+  static void Unref(Node *n);
+  static Node* Own(Node *n);
+  static unsigned int Count(Node *n) { return n ? n->count : 0; }
+  static void Update(Node *n);
+
+  // Read helpers shared with Version
+  static Node* Find(Node *n, const K &key);
+  static const V& Get(Node *n, const K &key);
+  static Node* MinNode(Node *n);
+  static Node* MaxNode(Node *n);
+  template <typename F>
+  static void ForEach(Node *n, F &f);
+  static void Dump(Node *n, DumpSink &sink, DumpFormat format);
+
+  // Recursive helper methods; each takes over the reference held on @h
+  // and returns the one for the subtree that replaces it
+  static Node* Insert(Node *h, const K &key, const V &value);
+  static Node* PopFront(Node *h, const K &key);
+  static Node* Delete(Node *h, const K &key);
+  static Node* DeleteMin(Node *h);
+
+  // Helper methods for the self-balancing, on nodes already owned
+  static bool IsRed(Node *n) { return n && n->color == RED; }
+  static void FlipColors(Node *h);
+  static Node* RotateLeft(Node *h);
+  static Node* RotateRight(Node *h);
+  static Node* FixUp(Node *h);
+  static Node* MoveRedLeft(Node *h);
+  static Node* MoveRedRight(Node *h);
+
+  Node *root_ = nullptr;
+};
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::Ref(Node *n) {
+  if (n)
+    n->refs.fetch_add(1, std::memory_order_relaxed);
+  return n;
+}
+
+// Drop a reference to @n, freeing it and releasing its children if it was
+// the last one
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::Unref(Node *n) {
+  if (n && n->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    Unref(n->left);
+    Unref(n->right);
+    delete n;
+  }
+}
+
+// Return @n if the caller holds the only reference to it, otherwise trade
+// that reference for a private copy. The acquire pairs with the release in
+// Unref, so a reader that just let go is done with the node.
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::Own(Node *n) {
+  if (n->refs.load(std::memory_order_acquire) == 1)
+    return n;
+  Node *copy = new Node(*n);
+  Ref(copy->left);
+  Ref(copy->right);
+  Unref(n);
+  return copy;
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::Update(Node *n) {
+  n->count = n->values.size() + Count(n->left) + Count(n->right);
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::Find(Node *n, const K &key) {
+  while (n && !(key == n->key))
+    n = key < n->key ? n->left : n->right;
+  return n;
+}
+
+template <typename K, typename V>
+const V& Multi_Map<K, V, PersistentBackend>::Get(Node *n, const K &key) {
+  n = Find(n, key);
+  if (!n)
+    throw std::runtime_error("Error: cannot find key");
+  return n->values.front();
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::MinNode(Node *n) {
+  if (!n)
+    throw std::runtime_error("Error: tree is empty");
+  while (n->left) n = n->left;
+  return n;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::MaxNode(Node *n) {
+  if (!n)
+    throw std::runtime_error("Error: tree is empty");
+  while (n->right) n = n->right;
+  return n;
+}
+
+// In-order walk over an explicit stack, which the black height bounds
+template <typename K, typename V>
+template <typename F>
+void Multi_Map<K, V, PersistentBackend>::ForEach(Node *n, F &f) {
+  Node *stack[2 * std::numeric_limits<unsigned int>::digits + 2];
+  int depth = 0;
+  while (n || depth > 0) {
+    for (; n; n = n->left)
+      stack[depth++] = n;
+    n = stack[--depth];
+    for (const V &v : n->values)
+      f(n->key, v);
+    n = n->right;
+  }
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::Dump(Node *n, DumpSink &sink, DumpFormat format) {
+  DumpWriter<K, V> out(sink, format);
+  auto pair = [&](const K &key, const V &value) { out.Pair(key, value); };
+  ForEach(n, pair);
+  out.Finish();
+}
+
+template <typename K, typename V>
+V Multi_Map<K, V, PersistentBackend>::PopMin() {
+  Node *n = MinNode(root_);
+  V value = n->values.front();
+  if (n->values.size() > 1) {
+    root_ = PopFront(root_, n->key);
+    return value;
+  }
+  root_ = Own(root_);
+  if (!IsRed(root_->left) && !IsRed(root_->right))
+    root_->color = RED;
+  root_ = DeleteMin(root_);
+  if (root_)
+    root_->color = BLACK;
+  return value;
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::Insert(const K &key, const V &value) {
+  root_ = Insert(root_, key, value);
+  root_->color = BLACK;
+}
+
+template <typename K, typename V>
+bool Multi_Map<K, V, PersistentBackend>::Remove(const K &key) {
+  Node *n = Find(root_, key);
+  if (!n)
+    return false;
+  // Dropping one of several values leaves the shape alone
+  if (n->values.size() > 1) {
+    root_ = PopFront(root_, key);
+    return true;
+  }
+  root_ = Own(root_);
+  if (!IsRed(root_->left) && !IsRed(root_->right))
+    root_->color = RED;
+  root_ = Delete(root_, key);
+  if (root_)
+    root_->color = BLACK;
+  return true;
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::Clear() {
+  Unref(root_);
+  root_ = nullptr;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::Insert(Node *h, const K &key, const V &value) {
+  if (!h)
+    return new Node(RED, key, value);
+  h = Own(h);
+  if (key < h->key)
+    h->left = Insert(h->left, key, value);
+  else if (h->key < key)
+    h->right = Insert(h->right, key, value);
+  else
+    h->values.push_back(value); // add the value to the end of list
+  return FixUp(h);
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::PopFront(Node *h, const K &key) {
+  h = Own(h);
+  h->count--;
+  if (key < h->key)
+    h->left = PopFront(h->left, key);
+  else if (h->key < key)
+    h->right = PopFront(h->right, key);
+  else
+    h->values.pop_front(); // remove the first value in the list
+  return h;
+}
+
+// Sedgewick's LLRB delete; @key must be present with a single value
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::Delete(Node *h, const K &key) {
+  h = Own(h);
+  if (key < h->key) {
+    if (!IsRed(h->left) && !IsRed(h->left->left))
+      h = MoveRedLeft(h);
+    h->left = Delete(h->left, key);
+    return FixUp(h);
+  }
+  if (IsRed(h->left))
+    h = RotateRight(h);
+  if (key == h->key && !h->right) {
+    Unref(h);
+    return nullptr;
+  }
+  if (!IsRed(h->right) && !IsRed(h->right->left))
+    h = MoveRedRight(h);
+  if (key == h->key) {
+    // Take over the successor's key and values, then drop its node
+    Node *m = MinNode(h->right);
+    h->key = m->key;
+    h->values = m->values;
+    h->right = DeleteMin(h->right);
+  } else {
+    h->right = Delete(h->right, key);
+  }
+  return FixUp(h);
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::DeleteMin(Node *h) {
+  h = Own(h);
+  if (!h->left) {
+    Unref(h);
+    return nullptr;
+  }
+  if (!IsRed(h->left) && !IsRed(h->left->left))
+    h = MoveRedLeft(h);
+  h->left = DeleteMin(h->left);
+  return FixUp(h);
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::FlipColors(Node *h) {
+  h->left = Own(h->left);
+  h->right = Own(h->right);
+  h->color = !h->color;
+  h->left->color = !h->left->color;
+  h->right->color = !h->right->color;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::RotateLeft(Node *h) {
+  Node *x = h->right = Own(h->right);
+  h->right = x->left;
+  x->left = h;
+  x->color = h->color;
+  h->color = RED;
+  x->count = h->count;
+  Update(h);
+  return x;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::RotateRight(Node *h) {
+  Node *x = h->left = Own(h->left);
+  h->left = x->right;
+  x->right = h;
+  x->color = h->color;
+  h->color = RED;
+  x->count = h->count;
+  Update(h);
+  return x;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::FixUp(Node *h) {
+  // A child changed below, so recount before rotations pass counts around
+  Update(h);
+  // Rotate left if there is a right-leaning red node
+  if (IsRed(h->right) && !IsRed(h->left))
+    h = RotateLeft(h);
+  // Rotate right if red-red pair of nodes on left
+  if (IsRed(h->left) && IsRed(h->left->left))
+    h = RotateRight(h);
+  // Recoloring if both children are red
+  if (IsRed(h->left) && IsRed(h->right))
+    FlipColors(h);
+  return h;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::MoveRedLeft(Node *h) {
+  FlipColors(h);
+  if (IsRed(h->right->left)) {
+    h->right = RotateRight(h->right);
+    h = RotateLeft(h);
+    FlipColors(h);
+  }
+  return h;
+}
+
+template <typename K, typename V>
+typename Multi_Map<K, V, PersistentBackend>::Node*
+Multi_Map<K, V, PersistentBackend>::MoveRedRight(Node *h) {
+  FlipColors(h);
+  if (IsRed(h->left->left)) {
+    h = RotateRight(h);
+    FlipColors(h);
+  }
+  return h;
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, PersistentBackend>::Print() {
+  StreamSink sink(std::cout);
+  Dump(sink, DumpFormat::kText);
+  std::cout << std::endl;
+}
+
+#endif  // PERSISTENT_MULTIMAP_H_
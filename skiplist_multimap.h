@@ -0,0 +1,404 @@
+#ifndef SKIPLIST_MULTIMAP_H_
+#define SKIPLIST_MULTIMAP_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "epoch.h"
+#include "multimap.h"
+
+// Backend policy for a lock-free skip list
+struct SkipListBackend {};
+
+// Lock-free Multi-Map implementation using a skip list
+// Every operation but Clear may run from any number of threads
+// at once. Each value is its own node ordered by (key, insertion sequence),
+// so duplicates keep insertion order and every node has a unique place.
+// A node is deleted by marking its links, bottom level last; whoever sets
+// that last mark owns the removal and finds pass over marked nodes and
+// unlink them. Unlinked nodes are retired through Epoch, so readers never
+// touch freed memory. Get, Min and Max return copies for the same reason.
+template <typename K, typename V>
+class Multi_Map<K, V, SkipListBackend> {
+ public:
+  // Constructor
+  Multi_Map() {
+    for (auto &link : head_)
+      link.store(0);
+  }
+
+  // Destructor
+  ~Multi_Map() {
+    Clear();
+  }
+
+  // Nodes are shared between threads, so the list cannot be copied
+  Multi_Map(const Multi_Map &) = delete;
+  Multi_Map &operator=(const Multi_Map &) = delete;
+
+  // Return size of list
+  unsigned int Size();
+  // Return a copy of the first value associated to @key
+  V Get(const K &key);
+  // Return whether @key is found in list
+  bool Contains(const K &key);
+  // Return a copy of the max key in list
+  K Max();
+  // Return a copy of the min key in list
+  K Min();
+  // Remove and return the first value of the min key
+  V PopMin();
+  // Insert @value under @key
+  void Insert(const K &key, const V &value);
+  // Remove the first value of @key, return whether anything was removed
+  bool Remove(const K &key);
+  // Remove every key; no other thread may use the list meanwhile
+  void Clear();
+  // Print list in-order
+  void Print();
+  // Call @f(key, value) for every pair in key order, skipping pairs that
+  // are removed as the walk passes; reclamation waits until it is done
+  template <typename F>
+  void ForEach(F f);
+  // Write every pair to @sink in @format, through one large buffer
+  void Dump(DumpSink &sink, DumpFormat format = DumpFormat::kText);
+
+ private:
+  // Levels above the bottom are kept with probability 1/4 each
+  static constexpr int kMaxLevel = 16;
+
+  // A link is a Node* whose low bit marks the node holding it as deleted
+  using Link = std::atomic<uintptr_t>;
+
+  struct Node {
+    K key;
+    V value;
+    uint64_t seq;
+    int height;
+    // Removal is finished by whichever of the inserter and the remover is
+    // done with the links last
+    std::atomic<int> refs{2};
+
+    Node(const K &key, const V &value, uint64_t seq, int height)
+        : key(key), value(value), seq(seq), height(height) {}
+    // The links live right behind the node in the same allocation
+    Link *Next() { return reinterpret_cast<Link *>(this + 1); }
+  };
+
+  static Node *Ptr(uintptr_t link) { return reinterpret_cast<Node *>(link & ~uintptr_t(1)); }
+  static bool Marked(uintptr_t link) { return link & 1; }
+  static uintptr_t Raw(Node *n) { return reinterpret_cast<uintptr_t>(n); }
+
+  // Whether @n sorts before position (@key, @seq)
+  static bool Before(Node *n, const K &key, uint64_t seq) {
+    return n->key < key || (!(key < n->key) && n->seq < seq);
+  }
+
+  static Node *NewNode(const K &key, const V &value, uint64_t seq, int height);
+  static void DeleteNode(void *p);
+  static int RandomHeight();
+
+  bool Find(const K &key, uint64_t seq, Link *preds[], Node *succs[]);
+  Node *FirstLive();
+  Node *FirstLive(const K &key);
+  bool MarkNode(Node *n);
+  void Release(Node *n);
+
+  Link head_[kMaxLevel];
+  std::atomic<uint64_t> next_seq_{0};
+  std::atomic<int64_t> size_{0};
+};
+
+template <typename K, typename V>
+typename Multi_Map<K, V, SkipListBackend>::Node*
+Multi_Map<K, V, SkipListBackend>::NewNode(const K &key, const V &value,
+                                          uint64_t seq, int height) {
+  void *mem = ::operator new(sizeof(Node) + height * sizeof(Link));
+  Node *n = new (mem) Node(key, value, seq, height);
+  for (int i = 0; i < height; i++)
+    new (&n->Next()[i]) Link(0);
+  return n;
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, SkipListBackend>::DeleteNode(void *p) {
+  Node *n = static_cast<Node *>(p);
+  n->~Node();
+  ::operator delete(p);
+}
+
+template <typename K, typename V>
+int Multi_Map<K, V, SkipListBackend>::RandomHeight() {
+  // xorshift per thread; two bits per level for the 1/4 branching
+  thread_local uint64_t state =
+      0x9E3779B97F4A7C15ull ^ reinterpret_cast<uintptr_t>(&state);
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  int height = 1;
+  for (uint64_t bits = state; height < kMaxLevel && (bits & 3) == 0; bits >>= 2)
+    height++;
+  return height;
+}
+
+// Fill @preds with the link arrays of the last nodes before (@key, @seq) and
+// @succs with the nodes after them, level by level, unlinking marked nodes
+// on the way. Return whether the bottom successor is exactly (@key, @seq).
+template <typename K, typename V>
+bool Multi_Map<K, V, SkipListBackend>::Find(const K &key, uint64_t seq,
+                                            Link *preds[], Node *succs[]) {
+retry:
+  Link *pred = head_;
+  for (int level = kMaxLevel - 1; level >= 0; level--) {
+    Node *curr = Ptr(pred[level].load());
+    while (curr) {
+      uintptr_t next = curr->Next()[level].load();
+      if (Marked(next)) {
+        // Snip the deleted node; a changed or marked pred means start over
+        uintptr_t expected = Raw(curr);
+        if (!pred[level].compare_exchange_strong(expected, next & ~uintptr_t(1)))
+          goto retry;
+        curr = Ptr(next);
+        continue;
+      }
+      if (!Before(curr, key, seq))
+        break;
+      pred = curr->Next();
+      curr = Ptr(next);
+    }
+    preds[level] = pred;
+    succs[level] = curr;
+  }
+  return succs[0] && succs[0]->seq == seq && !(succs[0]->key < key) &&
+         !(key < succs[0]->key);
+}
+
+// First node at the bottom level that is not being deleted
+template <typename K, typename V>
+typename Multi_Map<K, V, SkipListBackend>::Node*
+Multi_Map<K, V, SkipListBackend>::FirstLive() {
+  Node *n = Ptr(head_[0].load());
+  while (n && Marked(n->Next()[0].load()))
+    n = Ptr(n->Next()[0].load());
+  return n;
+}
+
+// Mark every link of @n, top down; return whether this call set the
+// bottom mark and so owns the removal
+template <typename K, typename V>
+bool Multi_Map<K, V, SkipListBackend>::MarkNode(Node *n) {
+  for (int level = n->height - 1; level > 0; level--)
+    n->Next()[level].fetch_or(1);
+  return !Marked(n->Next()[0].fetch_or(1));
+}
+
+// Drop the inserter's or the remover's reference to @n; the last one out
+// retires it, which only happens once the node is marked and unlinked
+template <typename K, typename V>
+void Multi_Map<K, V, SkipListBackend>::Release(Node *n) {
+  if (n->refs.fetch_sub(1) == 1)
+    Epoch::Retire(n, &DeleteNode);
+}
+
+template <typename K, typename V>
+unsigned int Multi_Map<K, V, SkipListBackend>::Size() {
+  return static_cast<unsigned int>(size_.load(std::memory_order_relaxed));
+}
+
+// First node of @key that is not being deleted, without helping unlink;
+// the caller must be pinned
+template <typename K, typename V>
+typename Multi_Map<K, V, SkipListBackend>::Node*
+Multi_Map<K, V, SkipListBackend>::FirstLive(const K &key) {
+  Link *pred = head_;
+  Node *curr = nullptr;
+  for (int level = kMaxLevel - 1; level >= 0; level--) {
+    curr = Ptr(pred[level].load());
+    while (curr && Before(curr, key, 0)) {
+      pred = curr->Next();
+      curr = Ptr(pred[level].load());
+    }
+  }
+  for (; curr && !(key < curr->key); curr = Ptr(curr->Next()[0].load())) {
+    if (!Marked(curr->Next()[0].load()))
+      return curr;
+  }
+  return nullptr;
+}
+
+template <typename K, typename V>
+V Multi_Map<K, V, SkipListBackend>::Get(const K &key) {
+  Epoch::Guard guard;
+  Node *n = FirstLive(key);
+  if (!n)
+    throw std::runtime_error("Error: cannot find key");
+  return n->value;
+}
+
+template <typename K, typename V>
+bool Multi_Map<K, V, SkipListBackend>::Contains(const K &key) {
+  Epoch::Guard guard;
+  return FirstLive(key) != nullptr;
+}
+
+template <typename K, typename V>
+K Multi_Map<K, V, SkipListBackend>::Max() {
+  Epoch::Guard guard;
+  // Run right on each level, then finish along the bottom
+  Link *pred = head_;
+  for (int level = kMaxLevel - 1; level > 0; level--) {
+    while (Node *next = Ptr(pred[level].load()))
+      pred = next->Next();
+  }
+  Node *last = nullptr;
+  for (Node *n = Ptr(pred[0].load()); n; n = Ptr(n->Next()[0].load())) {
+    if (!Marked(n->Next()[0].load()))
+      last = n;
+  }
+  // The tail may all be mid-delete; fall back to a full bottom scan
+  if (!last) {
+    for (Node *n = Ptr(head_[0].load()); n; n = Ptr(n->Next()[0].load()))
+      if (!Marked(n->Next()[0].load()))
+        last = n;
+  }
+  if (!last)
+    throw std::runtime_error("Error: tree is empty");
+  return last->key;
+}
+
+template <typename K, typename V>
+K Multi_Map<K, V, SkipListBackend>::Min() {
+  Epoch::Guard guard;
+  Node *n = FirstLive();
+  if (!n)
+    throw std::runtime_error("Error: tree is empty");
+  return n->key;
+}
+
+template <typename K, typename V>
+V Multi_Map<K, V, SkipListBackend>::PopMin() {
+  Epoch::Guard guard;
+  while (Node *n = FirstLive()) {
+    if (!MarkNode(n))
+      continue;  // another thread took it first
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    V value = n->value;
+    Link *preds[kMaxLevel];
+    Node *succs[kMaxLevel];
+    Find(n->key, n->seq, preds, succs);
+    Release(n);
+    return value;
+  }
+  throw std::runtime_error("Error: tree is empty");
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, SkipListBackend>::Insert(const K &key, const V &value) {
+  Epoch::Guard guard;
+  uint64_t seq = next_seq_.fetch_add(1, std::memory_order_relaxed);
+  int height = RandomHeight();
+  Node *n = NewNode(key, value, seq, height);
+  Link *preds[kMaxLevel];
+  Node *succs[kMaxLevel];
+  // Counted ahead of publishing so a racing Remove never drives it negative
+  size_.fetch_add(1, std::memory_order_relaxed);
+
+  // Publishing on the bottom level is the linearization point
+  while (true) {
+    Find(key, seq, preds, succs);
+    for (int level = 0; level < height; level++)
+      n->Next()[level].store(Raw(succs[level]));
+    uintptr_t expected = Raw(succs[0]);
+    if (preds[0][0].compare_exchange_strong(expected, Raw(n)))
+      break;
+  }
+
+  // Upper levels are only shortcuts; stop as soon as the node is deleted
+  for (int level = 1; level < height; level++) {
+    while (true) {
+      uintptr_t next = n->Next()[level].load();
+      if (Marked(next))
+        goto linked;
+      if (Ptr(next) != succs[level] &&
+          !n->Next()[level].compare_exchange_strong(next, Raw(succs[level])))
+        goto linked;
+      uintptr_t expected = Raw(succs[level]);
+      if (preds[level][level].compare_exchange_strong(expected, Raw(n)))
+        break;
+      Find(key, seq, preds, succs);
+      if (succs[0] != n)
+        goto linked;
+    }
+  }
+linked:
+  // A remover may have finished its cleanup before a level above was
+  // linked, so unlink again before letting go
+  if (Marked(n->Next()[0].load()))
+    Find(key, seq, preds, succs);
+  Release(n);
+}
+
+template <typename K, typename V>
+bool Multi_Map<K, V, SkipListBackend>::Remove(const K &key) {
+  Epoch::Guard guard;
+  Link *preds[kMaxLevel];
+  Node *succs[kMaxLevel];
+  while (true) {
+    // Marked nodes are unlinked by the search, so this is the first live one
+    Find(key, 0, preds, succs);
+    Node *n = succs[0];
+    if (!n || key < n->key)
+      return false;
+    if (!MarkNode(n))
+      continue;
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    Find(key, n->seq, preds, succs);
+    Release(n);
+    return true;
+  }
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, SkipListBackend>::Clear() {
+  Node *n = Ptr(head_[0].load());
+  while (n) {
+    Node *next = Ptr(n->Next()[0].load());
+    // With no operation in flight every linked node is live
+    DeleteNode(n);
+    n = next;
+  }
+  for (auto &link : head_)
+    link.store(0);
+  size_.store(0);
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, SkipListBackend>::Print() {
+  StreamSink sink(std::cout);
+  Dump(sink, DumpFormat::kText);
+  std::cout << std::endl;
+}
+
+template <typename K, typename V>
+template <typename F>
+void Multi_Map<K, V, SkipListBackend>::ForEach(F f) {
+  Epoch::Guard guard;
+  for (Node *n = FirstLive(); n; n = Ptr(n->Next()[0].load())) {
+    if (!Marked(n->Next()[0].load()))
+      f(static_cast<const K&>(n->key), static_cast<const V&>(n->value));
+  }
+}
+
+template <typename K, typename V>
+void Multi_Map<K, V, SkipListBackend>::Dump(DumpSink &sink, DumpFormat format) {
+  DumpWriter<K, V> out(sink, format);
+  ForEach([&](const K &key, const V &value) { out.Pair(key, value); });
+  out.Finish();
+}
+
+#endif  // SKIPLIST_MULTIMAP_H_
@@ -0,0 +1,317 @@
+#ifndef STATIC_MULTIMAP_H_
+#define STATIC_MULTIMAP_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "llrb.h"
+#include "multimap.h"
+
+// Backend policy for a fixed-capacity tree of at most N entries
+template <std::size_t N>
+struct StaticBackend {};
+
+// Static Multi-Map implementation using a left-leaning red-black tree
+// Nodes live in an std::array inside the object and link to each other by
+// index, so the map never touches the heap and copies like a plain value.
+// With literal K and V, a constexpr function can fill one and return it
+// as a compile-time table. Every entry has a node of its own, and entries
+// with equal keys stay in insertion order: a per-node sequence number
+// breaks the tie. Balancing is the LLRB code Multi_Map runs on.
+// K and V must be default-constructible.
+template <typename K, typename V, std::size_t N>
+class Multi_Map<K, V, StaticBackend<N>> {
+ public:
+  // Constructor
+  constexpr Multi_Map() = default;
+
+  // Return size of tree
+  constexpr unsigned int Size() const { return size_; }
+  // Return the most entries the tree can hold
+  static constexpr std::size_t Capacity() { return N; }
+  // Return the first value associated to @key
+  constexpr const V& Get(const K &key) const;
+  // Return whether @key is found in tree
+  constexpr bool Contains(const K &key) const { return Find(key) != kNil; }
+  // Return max key in tree
+  constexpr const K& Max() const;
+  // Return min key in tree
+  constexpr const K& Min() const;
+  // Remove and return the first value of the min key
+  constexpr V PopMin();
+  // Insert @key in tree after any values it already has
+  constexpr void Insert(const K &key, const V &value);
+  // Remove the first value of @key, return whether anything was removed
+  constexpr bool Remove(const K &key);
+  // Remove every key
+  constexpr void Clear();
+  // Call @f(key, value) for every pair in key order
+  template <typename F>
+  constexpr void ForEach(F f) const { ForEach(root_, f); }
+
+ private:
+  friend struct LLRB<Multi_Map>;
+  using Tree = LLRB<Multi_Map>;
+  // Narrowest index type that leaves one value over for kNil
+  using Link = typename std::conditional<
+      (N < 0xff), uint8_t,
+      typename std::conditional<(N < 0xffff), uint16_t, uint32_t>::type>::type;
+  static_assert(N > 0, "StaticMulti_Map needs room for one entry");
+  static_assert(N < 0xffffffffu, "StaticMulti_Map capacity is too large");
+  static constexpr Link kNil = std::numeric_limits<Link>::max();
+
+  struct Node {
+    K key{};
+    V value{};
+    uint32_t seq = 0;  // insertion order among equal keys
+    Link left = kNil;  // next free slot while on the free list
+    Link right = kNil;
+    bool color = Tree::kBlack;
+  };
+
+  std::array<Node, N> nodes_{};
+  Link root_ = kNil;
+  Link free_ = kNil;     // recycled slots
+  std::size_t used_ = 0;  // slots handed out at least once
+  unsigned int size_ = 0;
+  uint32_t next_seq_ = 0;
+
+  // Accessors and hooks for the shared balancing
+  constexpr Link& LeftOf(Link n) { return nodes_[n].left; }
+  constexpr Link& RightOf(Link n) { return nodes_[n].right; }
+  constexpr bool ColorOf(Link n) const { return nodes_[n].color; }
+  constexpr void SetColorOf(Link n, bool c) { nodes_[n].color = c; }
+  constexpr void Rotated(Link, Link, bool) {}
+  constexpr void Flipped(Link) {}
+  constexpr void FixingUp(Link) {}
+
+  // Return whether (@key, @seq) orders before node @n
+  constexpr bool Less(const K &key, uint32_t seq, Link n) const {
+    return key < nodes_[n].key || (!(nodes_[n].key < key) && seq < nodes_[n].seq);
+  }
+  // Return the first node holding @key, kNil if none
+  constexpr Link Find(const K &key) const;
+  constexpr Link NewNode(const K &key, const V &value);
+  constexpr void FreeNode(Link n);
+  constexpr void Renumber(Link n, uint32_t &seq);
+
+  // Recursive helper methods
+  template <typename F>
+  constexpr void ForEach(Link n, F &f) const;
+  constexpr void Insert(Link &h, Link n);
+  constexpr void Delete(Link &h, const K &key, uint32_t seq);
+  constexpr Link DeleteMin(Link &h);
+};
+
+// Fixed-capacity Multi_Map usable in constant expressions
+template <typename K, typename V, std::size_t N>
+using StaticMulti_Map = Multi_Map<K, V, StaticBackend<N>>;
+
+template <typename K, typename V, std::size_t N>
+constexpr typename Multi_Map<K, V, StaticBackend<N>>::Link
+Multi_Map<K, V, StaticBackend<N>>::Find(const K &key) const {
+  Link best = kNil;
+  for (Link n = root_; n != kNil;) {
+    if (nodes_[n].key < key) {
+      n = nodes_[n].right;
+    } else {
+      if (!(key < nodes_[n].key))
+        best = n;
+      n = nodes_[n].left;
+    }
+  }
+  return best;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::Clear() {
+  for (std::size_t i = 0; i < used_; i++)
+    nodes_[i] = Node();
+  root_ = free_ = kNil;
+  used_ = 0;
+  size_ = 0;
+  next_seq_ = 0;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr const V& Multi_Map<K, V, StaticBackend<N>>::Get(const K &key) const {
+  Link n = Find(key);
+  if (n == kNil)
+    throw std::runtime_error("Error: cannot find key");
+  return nodes_[n].value;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr const K& Multi_Map<K, V, StaticBackend<N>>::Max() const {
+  if (root_ == kNil)
+    throw std::runtime_error("Error: tree is empty");
+  Link n = root_;
+  while (nodes_[n].right != kNil) n = nodes_[n].right;
+  return nodes_[n].key;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr const K& Multi_Map<K, V, StaticBackend<N>>::Min() const {
+  if (root_ == kNil)
+    throw std::runtime_error("Error: tree is empty");
+  Link n = root_;
+  while (nodes_[n].left != kNil) n = nodes_[n].left;
+  return nodes_[n].key;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr V Multi_Map<K, V, StaticBackend<N>>::PopMin() {
+  if (root_ == kNil)
+    throw std::runtime_error("Error: tree is empty");
+  if (!Tree::IsRed(*this, LeftOf(root_)) && !Tree::IsRed(*this, RightOf(root_)))
+    SetColorOf(root_, Tree::kRed);
+  Link n = DeleteMin(root_);
+  if (root_ != kNil)
+    SetColorOf(root_, Tree::kBlack);
+  V value = std::move(nodes_[n].value);
+  FreeNode(n);
+  return value;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::Insert(const K &key, const V &value) {
+  Link n = NewNode(key, value);
+  Insert(root_, n);
+  SetColorOf(root_, Tree::kBlack);
+  size_++;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr bool Multi_Map<K, V, StaticBackend<N>>::Remove(const K &key) {
+  Link n = Find(key);
+  if (n == kNil)
+    return false;
+  if (!Tree::IsRed(*this, LeftOf(root_)) && !Tree::IsRed(*this, RightOf(root_)))
+    SetColorOf(root_, Tree::kRed);
+  Delete(root_, key, nodes_[n].seq);
+  if (root_ != kNil)
+    SetColorOf(root_, Tree::kBlack);
+  return true;
+}
+
+// Take a slot off the free list, or a fresh one, and fill it in
+template <typename K, typename V, std::size_t N>
+constexpr typename Multi_Map<K, V, StaticBackend<N>>::Link
+Multi_Map<K, V, StaticBackend<N>>::NewNode(const K &key, const V &value) {
+  Link n = kNil;
+  if (free_ != kNil) {
+    n = free_;
+    free_ = nodes_[n].left;
+  } else if (used_ < N) {
+    n = static_cast<Link>(used_++);
+  } else {
+    throw std::runtime_error("Error: static map is full");
+  }
+  // Sequence numbers ran out: hand them out again in key order
+  if (next_seq_ == std::numeric_limits<uint32_t>::max()) {
+    next_seq_ = 0;
+    Renumber(root_, next_seq_);
+  }
+  nodes_[n].key = key;
+  nodes_[n].value = value;
+  nodes_[n].seq = next_seq_++;
+  nodes_[n].left = nodes_[n].right = kNil;
+  nodes_[n].color = Tree::kRed;
+  return n;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::FreeNode(Link n) {
+  nodes_[n] = Node();
+  nodes_[n].left = free_;
+  free_ = n;
+  size_--;
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::Renumber(Link n, uint32_t &seq) {
+  if (n == kNil)
+    return;
+  Renumber(nodes_[n].left, seq);
+  nodes_[n].seq = seq++;
+  Renumber(nodes_[n].right, seq);
+}
+
+template <typename K, typename V, std::size_t N>
+template <typename F>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::ForEach(Link n, F &f) const {
+  if (n == kNil)
+    return;
+  ForEach(nodes_[n].left, f);
+  f(nodes_[n].key, nodes_[n].value);
+  ForEach(nodes_[n].right, f);
+}
+
+template <typename K, typename V, std::size_t N>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::Insert(Link &h, Link n) {
+  if (h == kNil) {
+    h = n;
+    return;
+  }
+  if (Less(nodes_[n].key, nodes_[n].seq, h))
+    Insert(LeftOf(h), n);
+  else
+    Insert(RightOf(h), n);
+  Tree::FixUp(*this, h);
+}
+
+// Unlink and free the node ordered as (@key, @seq), which must be in the
+// tree at @h; top-down like Multi_Map::Remove, but recursive
+template <typename K, typename V, std::size_t N>
+constexpr void Multi_Map<K, V, StaticBackend<N>>::Delete(Link &h, const K &key, uint32_t seq) {
+  if (Less(key, seq, h)) {
+    if (!Tree::IsRed(*this, LeftOf(h)) && !Tree::IsRed(*this, LeftOf(LeftOf(h))))
+      Tree::MoveRedLeft(*this, h);
+    Delete(LeftOf(h), key, seq);
+  } else {
+    if (Tree::IsRed(*this, LeftOf(h)))
+      Tree::RotateRight(*this, h);
+    if (nodes_[h].seq == seq && RightOf(h) == kNil) {
+      FreeNode(h);
+      h = kNil;
+      return;
+    }
+    if (!Tree::IsRed(*this, RightOf(h)) && !Tree::IsRed(*this, LeftOf(RightOf(h))))
+      Tree::MoveRedRight(*this, h);
+    if (nodes_[h].seq == seq) {
+      // Put the successor in the found node's place
+      Link m = DeleteMin(RightOf(h));
+      nodes_[m].left = nodes_[h].left;
+      nodes_[m].right = nodes_[h].right;
+      nodes_[m].color = nodes_[h].color;
+      FreeNode(h);
+      h = m;
+    } else {
+      Delete(RightOf(h), key, seq);
+    }
+  }
+  Tree::FixUp(*this, h);
+}
+
+// Unlink the min node of the tree at @h and return it
+template <typename K, typename V, std::size_t N>
+constexpr typename Multi_Map<K, V, StaticBackend<N>>::Link
+Multi_Map<K, V, StaticBackend<N>>::DeleteMin(Link &h) {
+  if (LeftOf(h) == kNil) {
+    Link m = h;
+    h = kNil;
+    return m;
+  }
+  if (!Tree::IsRed(*this, LeftOf(h)) && !Tree::IsRed(*this, LeftOf(LeftOf(h))))
+    Tree::MoveRedLeft(*this, h);
+  Link m = DeleteMin(LeftOf(h));
+  Tree::FixUp(*this, h);
+  return m;
+}
+
+#endif  // STATIC_MULTIMAP_H_
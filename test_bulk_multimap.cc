@@ -0,0 +1,161 @@
+// Join-based bulk operations on inputs large enough to fork
+// Built without MULTI_MAP_ENABLE_STATS, which keeps them serial, so the
+// ForkJoinPool split and the shared dead list really run; run it under
+// -fsanitize=thread too.
+//
+//   g++ -std=c++17 -O2 test_bulk_multimap.cc -o test_bulk_multimap -lgtest -pthread
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "multimap.h"
+
+namespace {
+
+using Map = Multi_Map<int, int>;
+using Ref = std::multimap<int, int>;
+
+// Several times kForkCutoff, so the recursion forks a few levels deep
+constexpr int kSize = 1 << 17;
+
+// Fill @map and @ref alike with @n random pairs, some keys repeated
+void Fill(Map &map, Ref &ref, int n, int range, int tag, std::mt19937 &rng) {
+  for (int i = 0; i < n; i++) {
+    int key = static_cast<int>(rng() % range);
+    map.Insert(key, tag + i);
+    ref.insert({key, tag + i});
+  }
+}
+
+// Compare every pair in order, and the subtree counts through Rank,
+// Select and CountRange
+void ExpectSame(Map &map, const Ref &ref) {
+  ASSERT_EQ(map.Size(), ref.size());
+  std::vector<int> keys;
+  auto b = ref.begin();
+  for (auto a = map.begin(); a != map.end(); ++a, ++b) {
+    ASSERT_EQ(a->first, b->first);
+    ASSERT_EQ(a->second, b->second);
+    keys.push_back(b->first);
+  }
+  if (keys.empty())
+    return;
+  EXPECT_EQ(map.Min(), keys.front());
+  EXPECT_EQ(map.Max(), keys.back());
+  for (std::size_t i = 0; i < keys.size(); i += keys.size() / 64 + 1) {
+    int key = keys[i];
+    unsigned int rank = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    EXPECT_EQ(map.Rank(key), rank);
+    EXPECT_EQ(map.Select(rank)->first, key);
+    EXPECT_EQ(map.CountRange(key, key + 1000),
+              std::upper_bound(keys.begin(), keys.end(), key + 1000) - keys.begin() - rank);
+  }
+}
+
+std::set<int> Keys(const Ref &ref) {
+  std::set<int> keys;
+  for (auto &p : ref)
+    keys.insert(p.first);
+  return keys;
+}
+
+}  // namespace
+
+// Duplicate keys of both sides end up ours first, then @other's
+TEST(BulkOps, UnionForks) {
+  ForkJoinPool pool(3);
+  std::mt19937 rng(1);
+  Map a, b;
+  Ref ra, rb;
+  Fill(a, ra, kSize, 4 * kSize, 0, rng);
+  Fill(b, rb, kSize, 4 * kSize, kSize, rng);
+  a.Union(b, pool);
+  ra.insert(rb.begin(), rb.end());
+  EXPECT_EQ(b.Size(), 0u);
+  ExpectSame(a, ra);
+  b.Insert(1, 1);
+  EXPECT_EQ(b.Size(), 1u);
+}
+
+TEST(BulkOps, IntersectAndDifferenceFork) {
+  ForkJoinPool pool(3);
+  std::mt19937 rng(2);
+  Map a, b, c;
+  Ref ra, rb, rc;
+  Fill(a, ra, kSize, kSize, 0, rng);
+  Fill(b, rb, kSize, 2 * kSize, kSize, rng);
+  Fill(c, rc, kSize / 2, 2 * kSize, 2 * kSize, rng);
+
+  a.Intersect(b, pool);
+  std::set<int> keep = Keys(rb);
+  for (auto it = ra.begin(); it != ra.end();)
+    it = keep.count(it->first) ? std::next(it) : ra.erase(it);
+  ExpectSame(a, ra);
+  ExpectSame(b, rb);
+
+  b.Difference(c, pool);
+  std::set<int> drop = Keys(rc);
+  for (auto it = rb.begin(); it != rb.end();)
+    it = drop.count(it->first) ? rb.erase(it) : std::next(it);
+  ExpectSame(b, rb);
+  ExpectSame(c, rc);
+
+  // Freed nodes went back to the pool and get used again
+  Fill(b, rb, kSize / 4, 2 * kSize, 3 * kSize, rng);
+  ExpectSame(b, rb);
+}
+
+TEST(BulkOps, SplitAndJoin) {
+  std::mt19937 rng(3);
+  Map a;
+  Ref ra;
+  Fill(a, ra, 2 * kSize, kSize, 0, rng);
+  for (int cut : {kSize / 3, 0, kSize}) {
+    Map right;
+    right.Insert(-5, -5);
+    a.Split(cut, right);
+    Ref upper(ra.lower_bound(cut), ra.end());
+    Ref lower(ra.begin(), ra.lower_bound(cut));
+    ExpectSame(a, lower);
+    ExpectSame(right, upper);
+    a.Join(right);
+    EXPECT_EQ(right.Size(), 0u);
+    ExpectSame(a, ra);
+  }
+}
+
+// Forks share one pool; results stay exact when several run at once
+TEST(BulkOps, ConcurrentCallersShareAPool) {
+  ForkJoinPool pool(2);
+  std::vector<std::thread> callers;
+  std::vector<int> ok(3, 0);
+  for (int t = 0; t < 3; t++) {
+    callers.emplace_back([&, t] {
+      std::mt19937 rng(10 + t);
+      Map a, b;
+      Ref ra, rb;
+      Fill(a, ra, kSize / 2, kSize, 0, rng);
+      Fill(b, rb, kSize / 2, kSize, kSize, rng);
+      a.Union(b, pool);
+      ra.insert(rb.begin(), rb.end());
+      bool same = a.Size() == ra.size();
+      auto r = ra.begin();
+      for (auto it = a.begin(); same && it != a.end(); ++it, ++r)
+        same = it->first == r->first && it->second == r->second;
+      ok[t] = same;
+    });
+  }
+  for (std::thread &t : callers)
+    t.join();
+  EXPECT_EQ(ok, std::vector<int>(3, 1));
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,12 +1,29 @@
+// Build with the hot-path counters on so Map.Stats can check them; the
+// counters keep bulk operations serial, so their forked paths are tested
+// in test_bulk_multimap.cc, built without them
+//
+//   g++ -std=c++17 -O2 test_multiset.cc -o test_multiset -lgtest -pthread
+#define MULTI_MAP_ENABLE_STATS
+
 #include <gtest/gtest.h>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "multimap.h"
+#include "bptree_multimap.h"
+#include "concurrent_multimap.h"
+#include "persistent_multimap.h"
+#include "skiplist_multimap.h"
+#include "static_multimap.h"
 
 // Test one key
 TEST(Map, OneKey) {
-  Map<int, int> map;
+  Multi_Map<int, int> map;
   std::vector<int> keys{2};
 
   for (auto i : keys) {
@@ -19,7 +36,7 @@ TEST(Map, OneKey) {
 
 // Test multiple keys
 TEST(Map, MultipleKeys) {
-  Map<int, int> map;
+  Multi_Map<int, int> map;
   std::vector<int> keys{2, 18, 42, 43};
 
   // Insert a bunch of keys
@@ -35,6 +52,863 @@ TEST(Map, MultipleKeys) {
   }
 }
 
+// Test duplicate keys keep their values in insertion order
+TEST(Map, DuplicateKeys) {
+  Multi_Map<int, int> map;
+  map.Insert(7, 1);
+  map.Insert(7, 2);
+  map.Insert(3, 3);
+
+  EXPECT_EQ(map.Size(), 3u);
+  EXPECT_EQ(map.Get(7), 1);
+  map.Remove(7);
+  EXPECT_EQ(map.Get(7), 2);
+  map.Remove(7);
+  EXPECT_EQ(map.Contains(7), false);
+  EXPECT_EQ(map.Size(), 1u);
+}
+
+// Test nodes are recycled across removes and after Clear
+TEST(Map, ClearAndReuse) {
+  Multi_Map<int, std::string> map;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 1000; i++)
+      map.Insert(i, std::to_string(i));
+    for (int i = 0; i < 1000; i += 2)
+      map.Remove(i);
+    EXPECT_EQ(map.Size(), 500u);
+    EXPECT_EQ(map.Get(999), "999");
+    EXPECT_EQ(map.Contains(998), false);
+    map.Clear();
+    EXPECT_EQ(map.Size(), 0u);
+    EXPECT_EQ(map.Contains(1), false);
+  }
+}
+
+// Test PopMin drains keys in order and duplicates in FIFO order
+TEST(Map, PopMin) {
+  Multi_Map<int, int> map;
+  std::vector<int> keys{5, 1, 9, 1, 3, 7, 5};
+  for (size_t i = 0; i < keys.size(); i++)
+    map.Insert(keys[i], static_cast<int>(i));
+
+  EXPECT_EQ(map.Min(), 1);
+  EXPECT_EQ(map.PopMin(), 1);
+  EXPECT_EQ(map.PopMin(), 3);
+  EXPECT_EQ(map.Min(), 3);
+  EXPECT_EQ(map.PopMin(), 4);
+  EXPECT_EQ(map.PopMin(), 0);
+  EXPECT_EQ(map.PopMin(), 6);
+  map.Remove(7);
+  EXPECT_EQ(map.Min(), 9);
+  EXPECT_EQ(map.PopMin(), 2);
+  EXPECT_EQ(map.Size(), 0u);
+  EXPECT_THROW(map.PopMin(), std::runtime_error);
+}
+
+// Test Remove reports misses and Erase drops one specific value
+TEST(Map, RemoveAndErase) {
+  Multi_Map<int, int> map;
+  for (int i = 0; i < 10; i++)
+    map.Insert(i % 3, i);
+
+  EXPECT_EQ(map.Remove(5), false);
+  EXPECT_EQ(map.Erase(1, 2), false);
+  EXPECT_EQ(map.Erase(1, 4), true);
+  EXPECT_EQ(map.Get(1), 1);
+  EXPECT_EQ(map.Remove(1), true);
+  EXPECT_EQ(map.Get(1), 7);
+  EXPECT_EQ(map.Erase(1, 7), true);
+  EXPECT_EQ(map.Contains(1), false);
+  EXPECT_EQ(map.Size(), 7u);
+}
+
+// Test value lists stay FIFO while they spill past the inline slots
+TEST(ValueList, RingSpill) {
+  ValueList<std::string, 2> list;
+  for (int i = 0; i < 5; i++)
+    list.push_back(std::to_string(i));
+  list.pop_front();
+  list.pop_front();
+  for (int i = 5; i < 12; i++)
+    list.push_back(std::to_string(i));
+  list.erase(std::find(list.begin(), list.end(), "7"));
+  list.erase(std::find(list.begin(), list.end(), "10"));
+
+  std::vector<std::string> expect{"2", "3", "4", "5", "6", "8", "9", "11"};
+  ASSERT_EQ(list.size(), expect.size());
+  for (size_t i = 0; i < expect.size(); i++)
+    EXPECT_EQ(list[i], expect[i]);
+
+  ValueList<std::string, 2> moved(std::move(list));
+  EXPECT_EQ(list.size(), 0u);
+  EXPECT_EQ(moved.front(), "2");
+  EXPECT_EQ(moved.back(), "11");
+}
+
+// Value whose copy throws once a shared budget of copies runs out
+struct FragileValue {
+  static int live;
+  static int copies_left;
+  std::string s;
+  explicit FragileValue(int i) : s(std::to_string(i)) { live++; }
+  FragileValue(const FragileValue &o) : s(o.s) {
+    if (copies_left-- == 0)
+      throw std::runtime_error("copy failed");
+    live++;
+  }
+  FragileValue(FragileValue &&o) noexcept : s(std::move(o.s)) { live++; }
+  ~FragileValue() { live--; }
+};
+int FragileValue::live = 0;
+int FragileValue::copies_left = 0;
+
+// Test a copy that throws part way leaves nothing behind, inline or not
+TEST(ValueList, ThrowingCopy) {
+  using List = ValueList<FragileValue, 2>;
+  {
+    List list;
+    for (int i = 0; i < 6; i++)
+      list.emplace_back(i);
+    for (int fail : {0, 1, 4}) {
+      FragileValue::copies_left = fail;
+      EXPECT_THROW(List copy(list), std::runtime_error);
+      EXPECT_EQ(FragileValue::live, 6);
+    }
+    List small;
+    small.emplace_back(0);
+    small.emplace_back(1);
+    FragileValue::copies_left = 1;
+    EXPECT_THROW(List copy(small), std::runtime_error);
+    EXPECT_EQ(FragileValue::live, 8);
+
+    FragileValue::copies_left = 100;
+    List copy(list);
+    EXPECT_EQ(copy.size(), 6u);
+    EXPECT_EQ(copy.back().s, "5");
+  }
+  EXPECT_EQ(FragileValue::live, 0);
+}
+
+// Test an insert whose value copy throws leaves the counts as they were
+TEST(Map, InsertThrowingCopy) {
+  {
+    Multi_Map<int, FragileValue> map;
+    FragileValue::copies_left = 100;
+    for (int i = 0; i < 20; i++)
+      map.Insert(i * 2, FragileValue(i));
+    FragileValue v(0);
+    for (int key : {9, 10}) {  // a new node, then a duplicate
+      FragileValue::copies_left = 0;
+      EXPECT_THROW(map.Insert(key, v), std::runtime_error);
+      EXPECT_EQ(map.Size(), 20u);
+      EXPECT_EQ(map.Rank(10), 5u);
+      EXPECT_EQ(map.Rank(39), 20u);
+      EXPECT_EQ(map.CountRange(0, 40), 20u);
+      EXPECT_EQ(map.Select(19)->first, 38);
+    }
+    FragileValue::copies_left = 100;
+    map.Insert(9, v);
+    EXPECT_EQ(map.Rank(10), 6u);
+    EXPECT_EQ(map.Select(5)->first, 9);
+  }
+  EXPECT_EQ(FragileValue::live, 0);
+}
+
+// Test bulk building from sorted pairs groups equal keys
+TEST(Map, BuildFromSorted) {
+  std::vector<std::pair<int, int>> pairs;
+  for (int i = 0; i < 1000; i++)
+    pairs.emplace_back(i / 3, i);
+
+  Multi_Map<int, int> map(pairs.begin(), pairs.end());
+  EXPECT_EQ(map.Size(), 1000u);
+  EXPECT_EQ(map.Min(), 0);
+  EXPECT_EQ(map.Max(), 333);
+  EXPECT_EQ(map.Get(100), 300);
+  map.Remove(100);
+  EXPECT_EQ(map.Get(100), 301);
+  map.Insert(-1, -1);
+  EXPECT_EQ(map.PopMin(), -1);
+  EXPECT_EQ(map.PopMin(), 0);
+
+  std::swap(pairs[10], pairs[500]);
+  EXPECT_THROW(map.BuildFromSorted(pairs.begin(), pairs.end()),
+               std::runtime_error);
+  EXPECT_EQ(map.Size(), 998u);
+}
+
+// Test batches merge behind existing values, both small and large
+TEST(Map, InsertBatch) {
+  Multi_Map<int, int> map;
+  for (int i = 0; i < 100; i++)
+    map.Insert(i, i);
+
+  std::vector<std::pair<int, int>> small{{50, -1}, {200, -2}, {50, -3}};
+  map.InsertBatch(small.begin(), small.end());
+  EXPECT_EQ(map.Size(), 103u);
+  EXPECT_EQ(map.Max(), 200);
+
+  std::vector<std::pair<int, int>> large;
+  for (int i = 199; i >= -50; i--)
+    large.emplace_back(i, 1000 + i);
+  map.InsertBatch(large.begin(), large.end());
+  EXPECT_EQ(map.Size(), 353u);
+  EXPECT_EQ(map.Min(), -50);
+
+  std::vector<int> expect{50, -1, -3, 1050};
+  for (int v : expect) {
+    EXPECT_EQ(map.Get(50), v);
+    map.Remove(50);
+  }
+  EXPECT_EQ(map.Contains(50), false);
+}
+
+// Test move insertion and in-place construction of values
+TEST(Map, MoveAndEmplace) {
+  Multi_Map<std::string, std::vector<int>> map;
+  std::string key = "alpha";
+  std::vector<int> value{1, 2, 3};
+  map.Insert(std::move(key), std::move(value));
+  EXPECT_EQ(value.empty(), true);
+
+  std::vector<int> &built = map.Emplace("alpha", 4, 9);
+  EXPECT_EQ(built.size(), 4u);
+  map.Emplace(std::string("beta"), 2, 7);
+  EXPECT_EQ(map.Size(), 3u);
+  EXPECT_EQ(map.Get("alpha").size(), 3u);
+  map.Remove("alpha");
+  EXPECT_EQ(map.Get("alpha"), std::vector<int>(4, 9));
+  EXPECT_EQ(map.Get("beta"), std::vector<int>(2, 7));
+}
+
+// Iterators visit duplicates and support range queries
+TEST(Map, Iterators) {
+  Multi_Map<int, int> map;
+  EXPECT_EQ(map.begin() == map.end(), true);
+  for (int i = 0; i < 20; i++)
+    map.Insert(i % 5, i);
+
+  std::vector<std::pair<int, int>> seen;
+  for (auto kv : map)
+    seen.push_back({kv.first, kv.second});
+  ASSERT_EQ(seen.size(), 20u);
+  EXPECT_EQ(seen[0], std::make_pair(0, 0));
+  EXPECT_EQ(seen[1], std::make_pair(0, 5));
+  EXPECT_EQ(seen[19], std::make_pair(4, 19));
+
+  auto range = map.equal_range(2);
+  EXPECT_EQ(std::distance(range.first, range.second), 4);
+  EXPECT_EQ(range.first->second, 2);
+  EXPECT_EQ(range.second->first, 3);
+  EXPECT_EQ(map.lower_bound(-1) == map.begin(), true);
+  EXPECT_EQ(map.upper_bound(4) == map.end(), true);
+  EXPECT_EQ(map.lower_bound(5) == map.end(), true);
+
+  // Values are mutable through the iterator
+  map.lower_bound(3)->second = 100;
+  EXPECT_EQ(map.Get(3), 100);
+
+  auto it = map.end();
+  --it;
+  EXPECT_EQ(it->first, 4);
+  EXPECT_EQ(it->second, 19);
+  EXPECT_EQ(std::distance(map.begin(), map.end()), 20);
+}
+
+// Order statistics count every duplicate
+TEST(Map, RankSelect) {
+  Multi_Map<int, int> map;
+  for (int i = 0; i < 100; i++)
+    map.Insert(i / 2, i);
+  EXPECT_EQ(map.Rank(0), 0u);
+  EXPECT_EQ(map.Rank(10), 20u);
+  EXPECT_EQ(map.Rank(1000), 100u);
+  EXPECT_EQ(map.Select(21)->first, 10);
+  EXPECT_EQ(map.Select(21)->second, 21);
+  EXPECT_EQ(map.Select(100) == map.end(), true);
+  EXPECT_EQ(map.CountRange(10, 19), 20u);
+  EXPECT_EQ(map.CountRange(19, 10), 0u);
+
+  map.Remove(10);
+  map.PopMin();
+  EXPECT_EQ(map.Rank(10), 19u);
+  EXPECT_EQ(map.CountRange(0, 10), 20u);
+  EXPECT_EQ(map.Select(0)->second, 1);
+}
+
+// Concurrent readers see a consistent value while writers churn
+TEST(ConcurrentMap, ReadersAndWriters) {
+  ConcurrentMulti_Map<int, int> map(8);
+  for (int i = 0; i < 1000; i++)
+    map.Insert(i, i);
+
+  std::vector<std::thread> threads;
+  std::atomic<bool> bad{false};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 2000; i++) {
+        int key = (i * 7 + t) % 1000;
+        if (t < 2 && i % 4 == 0) {
+          // Push a duplicate behind the original and take it back off
+          map.Insert(key, -1);
+          map.Erase(key, -1);
+        } else if (map.Get(key) != key) {
+          bad = true;
+        }
+      }
+    });
+  }
+  for (std::thread &t : threads)
+    t.join();
+  EXPECT_EQ(bad.load(), false);
+  EXPECT_EQ(map.Size(), 1000u);
+  EXPECT_EQ(map.Min(), 0);
+  EXPECT_EQ(map.Max(), 999);
+  EXPECT_EQ(map.Remove(5), true);
+  EXPECT_EQ(map.Contains(5), false);
+  map.Clear();
+  EXPECT_THROW(map.Min(), std::runtime_error);
+}
+
+// Producers insert while consumers pop min; every value comes out once
+TEST(SkipList, ProducersAndConsumers) {
+  Multi_Map<int, int, SkipListBackend> map;
+  map.Insert(3, 30);
+  map.Insert(1, 10);
+  map.Insert(3, 31);
+  EXPECT_EQ(map.Min(), 1);
+  EXPECT_EQ(map.Max(), 3);
+  EXPECT_EQ(map.Get(3), 30);
+  EXPECT_EQ(map.Remove(3), true);
+  EXPECT_EQ(map.Get(3), 31);
+  EXPECT_EQ(map.PopMin(), 10);
+  EXPECT_EQ(map.PopMin(), 31);
+  EXPECT_THROW(map.PopMin(), std::runtime_error);
+
+  const int kPerThread = 2000;
+  std::atomic<int> producing{2};
+  std::vector<int> seen[2];
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kPerThread; i++)
+        map.Insert((i * 31) % 100, t * kPerThread + i);
+      producing--;
+    });
+  }
+  for (int t = 0; t < 2; t++) {
+    threads.emplace_back([&, t] {
+      while (producing > 0 || map.Size() > 0) {
+        try {
+          seen[t].push_back(map.PopMin());
+        } catch (const std::runtime_error &) {
+        }
+      }
+    });
+  }
+  for (std::thread &t : threads)
+    t.join();
+  std::vector<int> all(seen[0]);
+  all.insert(all.end(), seen[1].begin(), seen[1].end());
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(all.size(), 2u * kPerThread);
+  for (int i = 0; i < 2 * kPerThread; i++)
+    EXPECT_EQ(all[i], i);
+}
+
+// Snapshots round-trip every duplicate and reject bad input
+TEST(Map, SerializeRoundTrip) {
+  Multi_Map<int, std::string> map;
+  for (int i = 0; i < 300; i++)
+    map.Insert(i % 97, std::to_string(i));
+  std::stringstream buf;
+  map.Serialize(buf);
+
+  Multi_Map<int, std::string> copy;
+  copy.Insert(-1, "stale");
+  copy.Deserialize(buf);
+  EXPECT_EQ(copy.Size(), 300u);
+  EXPECT_EQ(copy.Contains(-1), false);
+  auto a = map.begin();
+  for (auto b = copy.begin(); b != copy.end(); ++a, ++b) {
+    EXPECT_EQ(a->first, b->first);
+    EXPECT_EQ(a->second, b->second);
+  }
+  EXPECT_EQ(a == map.end(), true);
+  copy.Insert(50, "x");
+  EXPECT_EQ(copy.Rank(51), 163u);
+
+  std::string bytes = buf.str();
+  std::stringstream truncated(bytes.substr(0, bytes.size() - 3));
+  EXPECT_THROW(copy.Deserialize(truncated), std::runtime_error);
+  EXPECT_EQ(copy.Size(), 0u);
+  std::stringstream garbage("not a snapshot");
+  EXPECT_THROW(copy.Deserialize(garbage), std::runtime_error);
+
+  // A huge string length is caught when the characters run out; the
+  // first value's length follows the header, its key and its count
+  std::string huge = bytes;
+  uint64_t length = uint64_t(1) << 62;
+  std::memcpy(&huge[24 + sizeof(int) + sizeof(uint32_t)], &length, sizeof(length));
+  std::stringstream corrupt(huge);
+  EXPECT_THROW(copy.Deserialize(corrupt), std::runtime_error);
+  EXPECT_EQ(copy.Size(), 0u);
+}
+
+// Value whose codec throws on the third read, halfway through a snapshot
+struct Unreadable {
+  int x;
+};
+template <>
+struct MultiMapCodec<Unreadable> {
+  static int reads;
+  static void Write(std::ostream &out, const Unreadable &v) { MultiMapCodec<int>::Write(out, v.x); }
+  static bool Read(std::istream &in, Unreadable &v) {
+    if (++reads == 3)
+      throw std::logic_error("unreadable");
+    return MultiMapCodec<int>::Read(in, v.x);
+  }
+};
+int MultiMapCodec<Unreadable>::reads = 0;
+
+// Test an exception out of a codec leaves an empty map and no leaks
+TEST(Map, DeserializeThrowingCodec) {
+  Multi_Map<int, Unreadable> map;
+  for (int i = 0; i < 10; i++)
+    map.Insert(i, Unreadable{i});
+  std::stringstream buf;
+  map.Serialize(buf);
+  EXPECT_THROW(map.Deserialize(buf), std::logic_error);
+  EXPECT_EQ(map.Size(), 0u);
+  map.Insert(1, Unreadable{1});
+  EXPECT_EQ(map.Get(1).x, 1);
+}
+
+// Every dump format writes the pairs in order, quoting text where needed
+TEST(Map, Dump) {
+  Multi_Map<int, std::string> map;
+  map.Insert(2, "a,\"b\"");
+  map.Insert(1, "x");
+  map.Insert(2, "c");
+  auto dump = [&](DumpFormat format) {
+    std::ostringstream out;
+    StreamSink sink(out);
+    map.Dump(sink, format);
+    return out.str();
+  };
+  EXPECT_EQ(dump(DumpFormat::kText), "1: [x] \n2: [a,\"b\", c] \n");
+  EXPECT_EQ(dump(DumpFormat::kCsv), "key,value\n1,x\n2,\"a,\"\"b\"\"\"\n2,c\n");
+  EXPECT_EQ(dump(DumpFormat::kJson), "[\n[1,\"x\"],\n[2,\"a,\\\"b\\\"\"],\n[2,\"c\"]\n]\n");
+
+  std::stringstream binary(dump(DumpFormat::kBinary));
+  int key = 0;
+  std::string value;
+  EXPECT_EQ(MultiMapCodec<int>::Read(binary, key) && key == 1, true);
+  EXPECT_EQ(MultiMapCodec<std::string>::Read(binary, value) && value == "x", true);
+  EXPECT_EQ(MultiMapCodec<int>::Read(binary, key) && key == 2, true);
+
+  map.Clear();
+  EXPECT_EQ(dump(DumpFormat::kText), "");
+  EXPECT_EQ(dump(DumpFormat::kJson), "[]\n");
+
+  Multi_Map<int, double, PersistentBackend> persistent;
+  persistent.Insert(1, 0.5);
+  auto version = persistent.Snapshot();
+  persistent.Insert(2, 1e300);
+  std::ostringstream out;
+  StreamSink sink(out);
+  version.Dump(sink, DumpFormat::kCsv);
+  EXPECT_EQ(out.str(), "key,value\n1,0.5\n");
+
+  // The other backends dump exactly what the red-black tree does
+  Multi_Map<int, int> rb;
+  Multi_Map<int, int, BPlusTreeBackend<32>> bp;
+  Multi_Map<int, int, SkipListBackend> skip;
+  for (int i = 0; i < 500; i++) {
+    rb.Insert(i * 7 % 61, i);
+    bp.Insert(i * 7 % 61, i);
+    skip.Insert(i * 7 % 61, i);
+  }
+  for (int k = 0; k < 61; k += 3) {
+    rb.Remove(k);
+    bp.Remove(k);
+    skip.Remove(k);
+  }
+  for (DumpFormat format : {DumpFormat::kText, DumpFormat::kJson, DumpFormat::kBinary}) {
+    std::ostringstream a, b, c;
+    StreamSink sa(a), sb(b), sc(c);
+    rb.Dump(sa, format);
+    bp.Dump(sb, format);
+    skip.Dump(sc, format);
+    EXPECT_EQ(a.str(), b.str());
+    EXPECT_EQ(a.str(), c.str());
+  }
+}
+
+// Counters track rebalancing, allocation, lookup depth and duplicates
+TEST(Map, Stats) {
+  Multi_Map<int, int> map;
+  for (int i = 0; i < 1024; i++)
+    map.Insert(i, i);
+  MultiMapStats s = map.Stats();
+  EXPECT_EQ(s.node_allocations, 1024u);
+  EXPECT_GT(s.rotations_left, 0u);
+  EXPECT_GT(s.color_flips, 0u);
+  EXPECT_GT(s.fixups, 0u);
+  EXPECT_EQ(s.duplicate_appends, 0u);
+
+  for (int i = 0; i < 3; i++)
+    map.Insert(7, -i);
+  map.ResetStats();
+  for (int i = 0; i < 1024; i++)
+    EXPECT_EQ(map.Contains(i), true);
+  EXPECT_EQ(map.Contains(-1), false);
+  s = map.Stats();
+  EXPECT_EQ(s.rotations_left + s.rotations_right + s.node_allocations, 0u);
+  EXPECT_EQ(s.lookups, 1025u);
+  EXPECT_LE(s.max_lookup_depth, 20u);
+  EXPECT_GT(s.AvgLookupDepth(), 1.0);
+  EXPECT_LE(s.AvgLookupDepth(), s.max_lookup_depth);
+  EXPECT_EQ(s.size, 1027u);
+
+  map.Insert(7, 9);
+  s = map.Stats();
+  EXPECT_EQ(s.duplicate_appends, 1u);
+  EXPECT_EQ(s.max_duplicates, 5u);
+}
+
+// Re-keying stays in place between neighbours and relocates otherwise
+TEST(Map, UpdateKey) {
+  Multi_Map<int, int> map;
+  for (int i = 0; i < 10; i++)
+    map.Insert(i * 10, i);
+  map.Insert(50, 100);
+
+  EXPECT_EQ(map.UpdateKey(30, 3, 35), true);
+  EXPECT_EQ(map.Contains(30), false);
+  EXPECT_EQ(map.Get(35), 3);
+  EXPECT_EQ(map.UpdateKey(0, 0, -5), true);
+  EXPECT_EQ(map.Min(), -5);
+  EXPECT_EQ(map.UpdateKey(-5, 0, 95), true);
+  EXPECT_EQ(map.Min(), 10);
+  EXPECT_EQ(map.Rank(95), 10u);
+  // A value sharing its key leaves the other one behind
+  EXPECT_EQ(map.UpdateKey(50, 100, 5), true);
+  EXPECT_EQ(map.Get(50), 5);
+  EXPECT_EQ(map.Min(), 5);
+  EXPECT_EQ(map.UpdateKey(50, 7, 60), false);
+  EXPECT_EQ(map.UpdateKey(51, 5, 60), false);
+  EXPECT_EQ(map.Size(), 11u);
+  EXPECT_EQ(map.CountRange(5, 95), 11u);
+
+  std::vector<int> keys;
+  for (auto kv : map)
+    keys.push_back(kv.first);
+  EXPECT_EQ(std::is_sorted(keys.begin(), keys.end()), true);
+}
+
+// The hash-indexed tree answers like the plain one through every update
+TEST(Map, HashIndex) {
+  Multi_Map<int, int> plain;
+  Multi_Map<int, int, HashIndexBackend> hashed;
+  uint32_t seed = 7;
+  auto next = [&]() { return (seed = seed * 1103515245 + 12345) >> 16; };
+  for (int i = 0; i < 20000; i++) {
+    int key = next() % 2000;
+    switch (next() % 4) {
+      case 0:
+      case 1:
+        plain.Insert(key, i);
+        hashed.Insert(key, i);
+        break;
+      case 2:
+        EXPECT_EQ(hashed.Remove(key), plain.Remove(key));
+        break;
+      case 3:
+        if (plain.Contains(key)) {
+          int value = plain.Get(key);
+          EXPECT_EQ(hashed.UpdateKey(key, value, key + 3), plain.UpdateKey(key, value, key + 3));
+        }
+        break;
+    }
+    if (hashed.Size() > 0 && next() % 8 == 0) {
+      EXPECT_EQ(hashed.PopMin(), plain.PopMin());
+    }
+  }
+  EXPECT_EQ(hashed.Size(), plain.Size());
+  for (int key = 0; key < 2010; key++) {
+    ASSERT_EQ(hashed.Contains(key), plain.Contains(key));
+    if (plain.Contains(key)) {
+      EXPECT_EQ(hashed.Get(key), plain.Get(key));
+    }
+  }
+
+  std::stringstream buf;
+  plain.Serialize(buf);
+  hashed.Deserialize(buf);
+  EXPECT_EQ(hashed.Get(plain.Max()), plain.Get(plain.Max()));
+  hashed.Clear();
+  EXPECT_EQ(hashed.Contains(plain.Min()), false);
+  EXPECT_THROW(hashed.Get(0), std::runtime_error);
+}
+
+// Tombstoned keys vanish from every query and come back on insert
+TEST(Map, LazyRemove) {
+  Multi_Map<int, int> map;
+  map.SetLazyRemove(0.5);
+  for (int i = 0; i < 100; i++)
+    map.Insert(i, i);
+  for (int i = 0; i < 100; i += 2)
+    EXPECT_EQ(map.Remove(i), true);
+  EXPECT_EQ(map.Remove(0), false);
+  EXPECT_EQ(map.Size(), 50u);
+  EXPECT_EQ(map.Contains(10), false);
+  EXPECT_EQ(map.Min(), 1);
+  EXPECT_EQ(map.Max(), 99);
+  EXPECT_EQ(map.Rank(11), 5u);
+  EXPECT_EQ(map.Select(5)->first, 11);
+  EXPECT_EQ(map.lower_bound(10)->first, 11);
+  EXPECT_EQ(map.PopMin(), 1);
+  EXPECT_EQ(map.Min(), 3);
+
+  map.Insert(0, -1);
+  EXPECT_EQ(map.Min(), 0);
+  EXPECT_EQ(map.Get(0), -1);
+  int count = 0, last = -1;
+  for (auto kv : map) {
+    EXPECT_GT(kv.first, last);
+    last = kv.first;
+    count++;
+  }
+  EXPECT_EQ(count, 50);
+
+  // Crossing the limit compacts; going eager drops what is left
+  while (map.Size() > 10)
+    map.PopMin();
+  EXPECT_EQ(map.Min(), 81);
+  map.SetLazyRemove(0);
+  EXPECT_EQ(map.Remove(81), true);
+  EXPECT_EQ(map.Min(), 83);
+  EXPECT_THROW(map.SetLazyRemove(1.5), std::runtime_error);
+}
+
+// Batched lookups agree with Get, misses and tombstones included
+TEST(Map, GetMany) {
+  Multi_Map<int, int> map;
+  Multi_Map<int, int, HashIndexBackend> hashed;
+  std::vector<int> keys;
+  for (int i = 0; i < 1000; i++) {
+    map.Insert(i * 2, i);
+    hashed.Insert(i * 2, i);
+    keys.push_back(i % 7 == 0 ? i * 2 + 1 : i * 2);
+  }
+  map.SetLazyRemove(0.5);
+  map.Remove(4);
+  hashed.Remove(4);
+
+  std::vector<const int *> out(keys.size()), hashed_out(keys.size());
+  map.GetMany(keys.data(), keys.size(), out.data());
+  hashed.GetMany(keys.data(), keys.size(), hashed_out.data());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (!map.Contains(keys[i])) {
+      EXPECT_EQ(out[i], nullptr);
+      EXPECT_EQ(hashed_out[i], nullptr);
+    } else {
+      EXPECT_EQ(out[i], &map.Get(keys[i]));
+      EXPECT_EQ(*hashed_out[i], map.Get(keys[i]));
+    }
+  }
+  EXPECT_EQ(out[2], nullptr);
+  EXPECT_EQ(*out[3], 3);
+}
+
+// Set operations merge, filter and cut whole trees; serial in this build
+TEST(Map, SetOperations) {
+  ForkJoinPool pool(2);
+  Multi_Map<int, int> a, b;
+  for (int i = 0; i < 40000; i++)
+    a.Insert(i * 2, i);
+  for (int i = 0; i < 40000; i++)
+    b.Insert(i * 3, -i);
+  a.Union(b, pool);
+  EXPECT_EQ(b.Size(), 0u);
+  EXPECT_EQ(a.Size(), 80000u);
+  EXPECT_EQ(a.CountRange(0, 5), 5u);  // 0, 0, 2, 3, 4
+  auto range = a.equal_range(6);
+  EXPECT_EQ(range.first->second, 3);
+  EXPECT_EQ(std::next(range.first)->second, -2);
+
+  Multi_Map<int, int> odd;
+  for (int i = 1; i < 120000; i += 2)
+    odd.Insert(i, i);
+  a.Difference(odd, pool);
+  EXPECT_EQ(odd.Size(), 60000u);
+  EXPECT_EQ(a.Contains(3), false);
+  EXPECT_EQ(a.Contains(6), true);
+  Multi_Map<int, int> sixes;
+  for (int i = 0; i < 120000; i += 6)
+    sixes.Insert(i, 0);
+  a.Intersect(sixes, pool);
+  // Multiples of 6 below 80000 twice, the rest up to 120000 once
+  EXPECT_EQ(a.Size(), 2u * 13334 + 6666);
+  EXPECT_EQ(a.Max(), 119994);
+
+  EXPECT_EQ(a.EraseRange(6, 600), 200u);
+  EXPECT_EQ(a.Min(), 0);
+  EXPECT_EQ(a.upper_bound(0)->first, 606);
+
+  Multi_Map<int, int> right;
+  a.Split(606, right);
+  EXPECT_EQ(a.Size(), 2u);
+  EXPECT_EQ(right.Min(), 606);
+  a.Join(right);
+  EXPECT_EQ(right.Size(), 0u);
+  EXPECT_EQ(a.Select(2)->first, 606);
+  Multi_Map<int, int> low;
+  low.Insert(1, 1);
+  EXPECT_THROW(a.Join(low), std::runtime_error);
+}
+
+// Snapshots stay frozen and readable on other threads while the map moves on
+TEST(PersistentMap, Snapshots) {
+  Multi_Map<int, int, PersistentBackend> map;
+  for (int i = 0; i < 1000; i++)
+    map.Insert(i % 500, i);
+  auto before = map.Snapshot();
+  for (int i = 0; i < 250; i++)
+    map.Remove(i);
+  map.Insert(-1, -1);
+  EXPECT_EQ(map.PopMin(), -1);
+  EXPECT_EQ(map.Size(), 750u);
+  EXPECT_EQ(map.Get(0), 500);
+  EXPECT_EQ(before.Size(), 1000u);
+  EXPECT_EQ(before.Get(0), 0);
+  EXPECT_EQ(before.Min(), 0);
+  EXPECT_EQ(before.Max(), 499);
+
+  std::atomic<bool> stop{false};
+  std::atomic<int> bad{0};
+  std::thread reader([&] {
+    while (!stop) {
+      long sum = 0;
+      int last = -1;
+      before.ForEach([&](int key, int value) {
+        if (key < last) bad++;
+        last = key;
+        sum += value;
+      });
+      if (sum != 999 * 1000 / 2) bad++;
+    }
+  });
+  for (int i = 0; i < 20000; i++) {
+    map.Insert(i % 997, i);
+    map.Remove((i * 7) % 997);
+  }
+  stop = true;
+  reader.join();
+  EXPECT_EQ(bad.load(), 0);
+
+  auto copy = before;
+  before = map.Snapshot();
+  EXPECT_EQ(copy.Size(), 1000u);
+  EXPECT_EQ(before.Size(), map.Size());
+  map.Clear();
+  EXPECT_EQ(before.Contains(before.Min()), true);
+  EXPECT_THROW(map.PopMin(), std::runtime_error);
+}
+
+// A fixed-capacity table built at compile time
+constexpr StaticMulti_Map<int, int, 16> MakeTable() {
+  StaticMulti_Map<int, int, 16> map;
+  for (int i = 0; i < 12; i++)
+    map.Insert(i % 5, i);
+  map.Remove(3);
+  map.PopMin();
+  return map;
+}
+
+TEST(StaticMap, Constexpr) {
+  constexpr StaticMulti_Map<int, int, 16> table = MakeTable();
+  static_assert(table.Size() == 10, "entries left after the removals");
+  static_assert(table.Min() == 0 && table.Get(0) == 5, "PopMin took the first 0");
+  static_assert(table.Get(3) == 8, "Remove took the first 3");
+  static_assert(!table.Contains(7), "never inserted");
+
+  StaticMulti_Map<int, int, 16> map = table;
+  std::vector<std::pair<int, int>> seen;
+  map.ForEach([&](int k, int v) { seen.push_back({k, v}); });
+  ASSERT_EQ(seen.size(), 10u);
+  EXPECT_EQ(seen[0], std::make_pair(0, 5));
+  EXPECT_EQ(seen[1], std::make_pair(0, 10));
+  EXPECT_EQ(seen[9], std::make_pair(4, 9));
+  for (int i = 0; i < 6; i++)
+    map.Insert(100 + i, i);
+  EXPECT_THROW(map.Insert(0, 0), std::runtime_error);
+  EXPECT_EQ(map.Max(), 105);
+  EXPECT_EQ(map.Remove(0), true);
+  EXPECT_EQ(map.Get(0), 10);
+  map.Clear();
+  EXPECT_EQ(map.Size(), 0u);
+  EXPECT_THROW(map.PopMin(), std::runtime_error);
+}
+
+// Test the B+-tree backend against the red-black tree on the same ops
+TEST(BPlusTree, MatchesRedBlack) {
+  Multi_Map<int, int> rb;
+  Multi_Map<int, int, BPlusTreeBackend<32>> bp;
+  std::vector<int> keys;
+  for (int i = 0; i < 2000; i++)
+    keys.push_back((i * 7919) % 503);
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    rb.Insert(keys[i], static_cast<int>(i));
+    bp.Insert(keys[i], static_cast<int>(i));
+  }
+  for (size_t i = 0; i < keys.size(); i += 3) {
+    EXPECT_EQ(bp.Remove(keys[i]), rb.Remove(keys[i]));
+  }
+  EXPECT_EQ(bp.Remove(1000), false);
+
+  ASSERT_EQ(bp.Size(), rb.Size());
+  EXPECT_EQ(bp.Min(), rb.Min());
+  EXPECT_EQ(bp.Max(), rb.Max());
+  for (int k = 0; k < 503; k++) {
+    ASSERT_EQ(bp.Contains(k), rb.Contains(k));
+    if (rb.Contains(k)) {
+      EXPECT_EQ(bp.Get(k), rb.Get(k));
+    }
+  }
+  while (rb.Size() > 0)
+    ASSERT_EQ(bp.PopMin(), rb.PopMin());
+  EXPECT_EQ(bp.Size(), 0u);
+}
+
+// Test the node search against std::lower_bound/upper_bound
+template <typename K>
+void CheckNodeSearch() {
+  for (unsigned n = 0; n <= 70; n++) {
+    std::vector<K> keys;
+    for (unsigned i = 0; i < n; i++)
+      keys.push_back(static_cast<K>((i * 5) / 3));
+    for (int q = -3; q < 130; q++) {
+      K key = static_cast<K>(q);
+      ASSERT_EQ(NodeSearch<K>::LowerBound(keys.data(), n, key),
+                std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+      ASSERT_EQ(NodeSearch<K>::UpperBound(keys.data(), n, key),
+                std::upper_bound(keys.begin(), keys.end(), key) - keys.begin());
+    }
+  }
+}
+
+TEST(NodeSearch, MatchesStd) {
+  CheckNodeSearch<int32_t>();
+  CheckNodeSearch<int64_t>();
+  CheckNodeSearch<float>();
+  CheckNodeSearch<double>();
+  CheckNodeSearch<unsigned>();
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();